@@ -0,0 +1,571 @@
+/**
+ * @file   mock_server.c
+ * @date   Fri Oct 16 2026
+ *
+ * @brief  Local WebQQ stand-in server for offline benchmark
+ *
+ * Start the plugin with LWQQ_BASE_URL=http://127.0.0.1:8080 and every
+ * request goes to http://127.0.0.1:8080/<original host>/<original path>.
+ * The response is chosen by endpoint, the last segment of path
+ * (e.g. poll2, get_user_friends2).
+ *
+ * Replay: start the plugin with LWQQ_RECORD_DIR=<dir> against the live
+ * service, every response body is saved as <dir>/<endpoint>. Then run
+ * this server with -d <dir> and recorded bodies are served instead of
+ * the synthetic ones. Login cookies are always synthetic.
+ *
+ * Statistics of login requests, roster, polled messages and sent
+ * messages are printed every -s seconds, and on SIGINT.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define MOCK_MAX_CONN 256
+#define MOCK_IN_MAX (256*1024)
+#define MOCK_MYSELF "123456"
+
+typedef struct BUF {
+    char* p;
+    size_t len;
+    size_t cap;
+}BUF;
+
+typedef enum {
+    ST_READ,
+    ST_DELAY,///< a poll2 waiting the message interval
+    ST_WRITE
+}CONN_STATE;
+
+typedef struct CONN {
+    int fd;
+    CONN_STATE state;
+    BUF in;
+    BUF out;
+    size_t out_off;
+    size_t req_len;///< length of current request in in buffer
+    int keep_alive;
+    int continued;///< 100 Continue sent for current request
+    long due_ms;
+}CONN;
+
+static struct {
+    int port;
+    const char* dir;
+    int friends;
+    int groups;
+    int members;
+    int per_poll;
+    int interval;
+    int stat_interval;
+}opt = {
+    .port = 8080,
+    .friends = 100,
+    .groups = 10,
+    .members = 50,
+    .per_poll = 1,
+    .interval = 1000,
+    .stat_interval = 5,
+};
+
+static struct {
+    unsigned long requests;
+    unsigned long login;
+    unsigned long roster;
+    unsigned long polls;
+    unsigned long messages;
+    unsigned long sends;
+}counter,last;
+
+static CONN conns[MOCK_MAX_CONN];
+static unsigned long msg_seq = 1;
+static volatile sig_atomic_t quit = 0;
+
+static const unsigned char gif_1x1[] = {
+    0x47,0x49,0x46,0x38,0x39,0x61,0x01,0x00,0x01,0x00,0x80,0x00,0x00,0xff,0xff,
+    0xff,0x00,0x00,0x00,0x21,0xf9,0x04,0x01,0x00,0x00,0x00,0x00,0x2c,0x00,0x00,
+    0x00,0x00,0x01,0x00,0x01,0x00,0x00,0x02,0x02,0x44,0x01,0x00,0x3b
+};
+
+static long now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec*1000L+ts.tv_nsec/1000000;
+}
+
+static void buf_reserve(BUF* b,size_t extra)
+{
+    if(b->len+extra+1 <= b->cap) return;
+    size_t cap = b->cap?b->cap:4096;
+    while(cap < b->len+extra+1) cap *= 2;
+    b->p = realloc(b->p,cap);
+    b->cap = cap;
+}
+static void buf_append(BUF* b,const void* data,size_t len)
+{
+    buf_reserve(b,len);
+    memcpy(b->p+b->len,data,len);
+    b->len += len;
+    b->p[b->len] = '\0';
+}
+static void buf_printf(BUF* b,const char* fmt,...)
+{
+    va_list args;
+    int n;
+    va_start(args,fmt);
+    n = vsnprintf(NULL,0,fmt,args);
+    va_end(args);
+    buf_reserve(b,n);
+    va_start(args,fmt);
+    vsnprintf(b->p+b->len,n+1,fmt,args);
+    va_end(args);
+    b->len += n;
+}
+static void buf_consume(BUF* b,size_t len)
+{
+    memmove(b->p,b->p+len,b->len-len);
+    b->len -= len;
+    if(b->p) b->p[b->len] = '\0';
+}
+
+/** @return value of param in query string or body, 0 if missing */
+static long param_long(const char* str,const char* name)
+{
+    size_t nlen = strlen(name);
+    const char* p = str;
+    while(p && (p = strstr(p,name))){
+        if((p == str || p[-1] == '?' || p[-1] == '&') && p[nlen] == '=')
+            return atol(p+nlen+1);
+        p += nlen;
+    }
+    return 0;
+}
+
+/** load <dir>/<endpoint> recorded by LWQQ_RECORD_DIR */
+static int fixture_load(const char* endpoint,BUF* body)
+{
+    char path[512];
+    char chunk[4096];
+    size_t n;
+    FILE* f;
+    if(opt.dir == NULL) return 0;
+    snprintf(path,sizeof(path),"%s/%s",opt.dir,endpoint);
+    f = fopen(path,"rb");
+    if(f == NULL) return 0;
+    while((n = fread(chunk,1,sizeof(chunk),f)) > 0)
+        buf_append(body,chunk,n);
+    fclose(f);
+    return 1;
+}
+
+static void gen_friends(BUF* b)
+{
+    int i;
+    buf_printf(b,"{\"retcode\":0,\"result\":{\"friends\":[");
+    for(i=0;i<opt.friends;i++)
+        buf_printf(b,"%s{\"flag\":0,\"uin\":%d,\"categories\":0}",i?",":"",10000+i);
+    buf_printf(b,"],\"marknames\":[],\"categories\":[{\"index\":0,\"sort\":0,\"name\":\"mock\"}],"
+            "\"vipinfo\":[],\"info\":[");
+    for(i=0;i<opt.friends;i++)
+        buf_printf(b,"%s{\"face\":0,\"flag\":0,\"nick\":\"friend%d\",\"uin\":%d}",
+                i?",":"",i,10000+i);
+    buf_printf(b,"]}}");
+}
+static void gen_groups(BUF* b)
+{
+    int i;
+    buf_printf(b,"{\"retcode\":0,\"result\":{\"gmasklist\":[],\"gnamelist\":[");
+    for(i=0;i<opt.groups;i++)
+        buf_printf(b,"%s{\"flag\":1,\"name\":\"group%d\",\"gid\":%d,\"code\":%d}",
+                i?",":"",i,20000+i,30000+i);
+    buf_printf(b,"],\"gmarklist\":[]}}");
+}
+static void gen_group_detail(BUF* b,long gcode)
+{
+    long gid = gcode-10000;
+    long base = 1000000+(gid-20000)*opt.members;
+    int i;
+    buf_printf(b,"{\"retcode\":0,\"result\":{\"stats\":[");
+    for(i=0;i<opt.members;i++)
+        buf_printf(b,"%s{\"client_type\":1,\"uin\":%ld,\"stat\":10}",i?",":"",base+i);
+    buf_printf(b,"],\"minfo\":[");
+    for(i=0;i<opt.members;i++)
+        buf_printf(b,"%s{\"nick\":\"member%d\",\"province\":\"\",\"gender\":\"male\","
+                "\"uin\":%ld,\"country\":\"\",\"city\":\"\"}",i?",":"",i,base+i);
+    buf_printf(b,"],\"ginfo\":{\"face\":0,\"memo\":\"\",\"class\":10000,\"fingermemo\":\"\","
+            "\"code\":%ld,\"createtime\":0,\"flag\":1,\"level\":0,\"name\":\"group%ld\","
+            "\"gid\":%ld,\"owner\":%s,\"members\":[],\"option\":2},"
+            "\"cards\":[],\"vipinfo\":[]}}",gcode,gid-20000,gid,MOCK_MYSELF);
+}
+static void gen_poll(BUF* b)
+{
+    int i;
+    if(opt.per_poll <= 0 || opt.friends <= 0){
+        buf_printf(b,"{\"retcode\":102,\"errmsg\":\"\"}");
+        return;
+    }
+    buf_printf(b,"{\"retcode\":0,\"result\":[");
+    for(i=0;i<opt.per_poll;i++,msg_seq++){
+        buf_printf(b,"%s{\"poll_type\":\"message\",\"value\":{\"msg_id\":%lu,"
+                "\"from_uin\":%lu,\"to_uin\":%s,\"msg_id2\":%lu,\"msg_type\":9,"
+                "\"reply_ip\":1,\"time\":%ld,\"content\":[[\"font\",{\"size\":10,"
+                "\"color\":\"000000\",\"style\":[0,0,0],\"name\":\"\\u5B8B\\u4F53\"}],"
+                "\"mock message %lu\"]}}",i?",":"",msg_seq,10000+msg_seq%opt.friends,
+                MOCK_MYSELF,msg_seq,(long)time(NULL),msg_seq);
+    }
+    buf_printf(b,"]}");
+    counter.messages += opt.per_poll;
+}
+
+/**
+ * build the response of one endpoint.
+ * @param query query string and body of request
+ */
+static void respond(CONN* c,const char* endpoint,const char* query)
+{
+    BUF body = {0};
+    BUF* out = &c->out;
+    const char* type = "text/plain; charset=utf-8";
+    const char* cookies = NULL;
+
+    if(!strcmp(endpoint,"ver") || !strcmp(endpoint,"check") ||
+            !strcmp(endpoint,"login") || !strcmp(endpoint,"login2"))
+        counter.login++;
+    else if(!strcmp(endpoint,"get_user_friends2") ||
+            !strcmp(endpoint,"get_group_name_list_mask2") ||
+            !strcmp(endpoint,"get_friend_uin2") ||
+            !strcmp(endpoint,"get_group_info_ext2"))
+        counter.roster++;
+    else if(!strcmp(endpoint,"send_buddy_msg2") || !strcmp(endpoint,"send_qun_msg2"))
+        counter.sends++;
+
+    if(!strcmp(endpoint,"check"))
+        cookies = "Set-Cookie: ptvfsession=mock; PATH=/; DOMAIN=qq.com;\r\n";
+    else if(!strcmp(endpoint,"login"))
+        cookies = "Set-Cookie: ptcz=mock; PATH=/; DOMAIN=qq.com;\r\n"
+            "Set-Cookie: skey=@mock; PATH=/; DOMAIN=qq.com;\r\n"
+            "Set-Cookie: ptwebqq=mock; PATH=/; DOMAIN=qq.com;\r\n"
+            "Set-Cookie: ptuserinfo=mock; PATH=/; DOMAIN=qq.com;\r\n"
+            "Set-Cookie: uin=o0000" MOCK_MYSELF "; PATH=/; DOMAIN=qq.com;\r\n"
+            "Set-Cookie: ptisp=ctc; PATH=/; DOMAIN=qq.com;\r\n"
+            "Set-Cookie: pt2gguin=o0000" MOCK_MYSELF "; PATH=/; DOMAIN=qq.com;\r\n";
+
+    if(!strcmp(endpoint,"poll2")){
+        counter.polls++;
+        if(!fixture_load(endpoint,&body)) gen_poll(&body);
+    }else if(fixture_load(endpoint,&body)){
+    }else if(!strcmp(endpoint,"ver")){
+        buf_printf(&body,"ptuiV(201205211530)");
+    }else if(!strcmp(endpoint,"check")){
+        buf_printf(&body,"ptui_checkVC('0','!MCK','\\x00\\x00\\x00\\x00\\x00\\x01\\xe2\\x40');");
+    }else if(!strcmp(endpoint,"login")){
+        buf_printf(&body,"ptuiCB('0','0','http://web.qq.com/loginproxy.html?login2qq=1&webqq_type=10',"
+                "'0','login ok', 'mock');");
+    }else if(!strcmp(endpoint,"login2")){
+        buf_printf(&body,"{\"retcode\":0,\"result\":{\"uin\":%s,\"cip\":1,\"index\":1060,"
+                "\"port\":43415,\"status\":\"online\",\"vfwebqq\":\"mockvfwebqq\","
+                "\"psessionid\":\"mockpsessionid\",\"user_state\":0,\"f\":0}}",MOCK_MYSELF);
+    }else if(!strcmp(endpoint,"get_user_friends2")){
+        gen_friends(&body);
+    }else if(!strcmp(endpoint,"get_group_name_list_mask2")){
+        gen_groups(&body);
+    }else if(!strcmp(endpoint,"get_friend_uin2")){
+        long tuin = param_long(query,"tuin");
+        buf_printf(&body,"{\"retcode\":0,\"result\":{\"uiuin\":\"\",\"account\":%ld,\"uin\":%ld}}",
+                tuin+1000000,tuin);
+    }else if(!strcmp(endpoint,"get_group_info_ext2")){
+        gen_group_detail(&body,param_long(query,"gcode"));
+    }else if(!strcmp(endpoint,"get_friend_info2")){
+        buf_printf(&body,"{\"retcode\":0,\"result\":{\"face\":0,\"birthday\":{\"month\":1,"
+                "\"year\":1990,\"day\":1},\"occupation\":\"\",\"phone\":\"\",\"allow\":1,"
+                "\"college\":\"\",\"reg_time\":0,\"uin\":%ld,\"constel\":0,\"blood\":0,"
+                "\"homepage\":\"\",\"stat\":10,\"vip_info\":0,\"country\":\"\",\"city\":\"\","
+                "\"personal\":\"\",\"nick\":\"mock\",\"shengxiao\":0,\"email\":\"\","
+                "\"client_type\":1,\"province\":\"\",\"gender\":\"male\",\"mobile\":\"\"}}",
+                param_long(query,"tuin"));
+    }else if(!strcmp(endpoint,"get_online_buddies2")){
+        int i;
+        buf_printf(&body,"{\"retcode\":0,\"result\":[");
+        for(i=0;i<opt.friends;i+=2)
+            buf_printf(&body,"%s{\"uin\":%d,\"status\":\"online\",\"client_type\":1}",
+                    i?",":"",10000+i);
+        buf_printf(&body,"]}");
+    }else if(!strcmp(endpoint,"get_gface_sig2")){
+        buf_printf(&body,"{\"retcode\":0,\"result\":{\"reply\":0,\"gface_key\":\"mock\","
+                "\"gface_sig\":\"mock\"}}");
+    }else if(!strcmp(endpoint,"getface")){
+        type = "image/gif";
+        buf_append(&body,gif_1x1,sizeof(gif_1x1));
+    }else{
+        //send_buddy_msg2, send_qun_msg2 and everything else
+        buf_printf(&body,"{\"retcode\":0,\"result\":\"ok\"}");
+    }
+
+    buf_printf(out,"HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %zu\r\n%s%s\r\n",
+            type,body.len,cookies?cookies:"",
+            c->keep_alive?"Connection: Keep-Alive\r\n":"Connection: close\r\n");
+    buf_append(out,body.p?body.p:"",body.len);
+    free(body.p);
+}
+
+/** endpoint is the last path segment before query */
+static void endpoint_of(const char* target,char* buf,size_t size)
+{
+    size_t len = strcspn(target,"?#");
+    const char* end = target+len;
+    const char* begin = end;
+    while(begin > target && begin[-1] != '/') begin--;
+    len = end-begin;
+    if(len >= size) len = size-1;
+    memcpy(buf,begin,len);
+    buf[len] = '\0';
+}
+
+/**
+ * parse one complete request from in buffer.
+ * @return 1 if a request is handled, 0 need more data, -1 bad request
+ */
+static int conn_parse(CONN* c)
+{
+    char* head_end = strstr(c->in.p?c->in.p:"","\r\n\r\n");
+    char target[2048];
+    char endpoint[128];
+    const char* p;
+    long content_length = 0;
+    if(head_end == NULL)
+        return c->in.len >= MOCK_IN_MAX?-1:0;
+    *head_end = '\0';
+
+    if(sscanf(c->in.p,"%*s %2047s",target) != 1){
+        *head_end = '\r';
+        return -1;
+    }
+    if((p = strcasestr(c->in.p,"\r\nContent-Length:")))
+        content_length = atol(p+17);
+    c->keep_alive = strcasestr(c->in.p,"\r\nConnection: close") == NULL;
+    *head_end = '\r';
+
+    size_t head_len = head_end+4-c->in.p;
+    if(c->in.len < head_len+content_length){
+        //curl waits this before sending large post body
+        if(!c->continued && strcasestr(c->in.p,"\r\nExpect: 100-continue")){
+            static const char cont[] = "HTTP/1.1 100 Continue\r\n\r\n";
+            if(write(c->fd,cont,sizeof(cont)-1) < 0) return -1;
+            c->continued = 1;
+        }
+        return c->in.len >= MOCK_IN_MAX?-1:0;
+    }
+    c->continued = 0;
+    c->req_len = head_len+content_length;
+
+    //params may be in query string or url encoded post body
+    BUF query = {0};
+    buf_printf(&query,"%s&",strchr(target,'?')?strchr(target,'?')+1:"");
+    buf_append(&query,c->in.p+head_len,content_length);
+    endpoint_of(target,endpoint,sizeof(endpoint));
+    counter.requests++;
+
+    respond(c,endpoint,query.p);
+    free(query.p);
+    buf_consume(&c->in,c->req_len);
+    c->out_off = 0;
+    if(!strcmp(endpoint,"poll2") && opt.interval > 0){
+        c->state = ST_DELAY;
+        c->due_ms = now_ms()+opt.interval;
+    }else
+        c->state = ST_WRITE;
+    return 1;
+}
+
+static void conn_close(CONN* c)
+{
+    close(c->fd);
+    free(c->in.p);
+    free(c->out.p);
+    memset(c,0,sizeof(*c));
+    c->fd = -1;
+}
+
+static void conn_read(CONN* c)
+{
+    char chunk[16384];
+    ssize_t n;
+    while((n = read(c->fd,chunk,sizeof(chunk))) > 0)
+        buf_append(&c->in,chunk,n);
+    if(n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)){
+        conn_close(c);
+        return;
+    }
+    if(conn_parse(c) < 0)
+        conn_close(c);
+}
+
+static void conn_write(CONN* c)
+{
+    ssize_t n;
+    while(c->out_off < c->out.len){
+        n = write(c->fd,c->out.p+c->out_off,c->out.len-c->out_off);
+        if(n < 0){
+            if(errno == EAGAIN || errno == EWOULDBLOCK) return;
+            conn_close(c);
+            return;
+        }
+        c->out_off += n;
+    }
+    c->out.len = 0;
+    c->out_off = 0;
+    c->state = ST_READ;
+    if(!c->keep_alive){
+        conn_close(c);
+        return;
+    }
+    //pipelined request already in buffer
+    if(c->in.len && conn_parse(c) < 0)
+        conn_close(c);
+}
+
+static void stat_print(long elapsed_ms)
+{
+    double sec = elapsed_ms/1000.0;
+    if(sec <= 0) return;
+    fprintf(stderr,"req %lu (%.1f/s) login %lu roster %lu poll %lu msg %lu (%.1f/s) send %lu (%.1f/s)\n",
+            counter.requests,(counter.requests-last.requests)/sec,counter.login,counter.roster,
+            counter.polls,counter.messages,(counter.messages-last.messages)/sec,
+            counter.sends,(counter.sends-last.sends)/sec);
+    last = counter;
+}
+
+static void on_signal(int sig)
+{
+    quit = 1;
+}
+
+static void usage(const char* prog)
+{
+    fprintf(stderr,"usage: %s [-p port] [-d fixture_dir] [-f friends] [-g groups]\n"
+            "       [-m members_per_group] [-n messages_per_poll] [-i poll_interval_ms]\n"
+            "       [-s stat_interval_sec]\n",prog);
+}
+
+int main(int argc,char** argv)
+{
+    int ch;
+    int i;
+    int lfd;
+    int on = 1;
+    struct sockaddr_in addr;
+    struct pollfd pfd[MOCK_MAX_CONN+1];
+    CONN* pconn[MOCK_MAX_CONN+1];
+    long last_stat;
+
+    while((ch = getopt(argc,argv,"p:d:f:g:m:n:i:s:h")) != -1){
+        switch(ch){
+            case 'p': opt.port = atoi(optarg);break;
+            case 'd': opt.dir = optarg;break;
+            case 'f': opt.friends = atoi(optarg);break;
+            case 'g': opt.groups = atoi(optarg);break;
+            case 'm': opt.members = atoi(optarg);break;
+            case 'n': opt.per_poll = atoi(optarg);break;
+            case 'i': opt.interval = atoi(optarg);break;
+            case 's': opt.stat_interval = atoi(optarg);break;
+            default: usage(argv[0]);return 1;
+        }
+    }
+
+    signal(SIGPIPE,SIG_IGN);
+    signal(SIGINT,on_signal);
+    signal(SIGTERM,on_signal);
+
+    lfd = socket(AF_INET,SOCK_STREAM,0);
+    setsockopt(lfd,SOL_SOCKET,SO_REUSEADDR,&on,sizeof(on));
+    memset(&addr,0,sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(opt.port);
+    if(bind(lfd,(struct sockaddr*)&addr,sizeof(addr)) < 0 || listen(lfd,64) < 0){
+        perror("listen");
+        return 1;
+    }
+    fcntl(lfd,F_SETFL,O_NONBLOCK);
+    for(i=0;i<MOCK_MAX_CONN;i++) conns[i].fd = -1;
+    fprintf(stderr,"mock webqq server on http://127.0.0.1:%d\n",opt.port);
+
+    last_stat = now_ms();
+    while(!quit){
+        int n = 0;
+        long now = now_ms();
+        long timeout = opt.stat_interval>0?opt.stat_interval*1000L-(now-last_stat):-1;
+
+        pfd[n].fd = lfd;
+        pfd[n].events = POLLIN;
+        pconn[n++] = NULL;
+        for(i=0;i<MOCK_MAX_CONN;i++){
+            CONN* c = &conns[i];
+            if(c->fd < 0) continue;
+            if(c->state == ST_DELAY){
+                long wait = c->due_ms-now;
+                if(wait <= 0){
+                    c->state = ST_WRITE;
+                }else if(timeout < 0 || wait < timeout)
+                    timeout = wait;
+            }
+            pfd[n].fd = c->fd;
+            pfd[n].events = c->state == ST_WRITE?POLLOUT:c->state == ST_READ?POLLIN:0;
+            pconn[n++] = c;
+        }
+        if(timeout < 0 && opt.stat_interval > 0) timeout = 0;
+
+        if(poll(pfd,n,timeout) < 0 && errno != EINTR) break;
+
+        if(pfd[0].revents & POLLIN){
+            int fd;
+            while((fd = accept(lfd,NULL,NULL)) >= 0){
+                for(i=0;i<MOCK_MAX_CONN && conns[i].fd >= 0;i++);
+                if(i == MOCK_MAX_CONN){
+                    close(fd);
+                    continue;
+                }
+                fcntl(fd,F_SETFL,O_NONBLOCK);
+                setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&on,sizeof(on));
+                memset(&conns[i],0,sizeof(CONN));
+                conns[i].fd = fd;
+                conns[i].state = ST_READ;
+            }
+        }
+        for(i=1;i<n;i++){
+            CONN* c = pconn[i];
+            if(c->fd < 0) continue;
+            if(pfd[i].revents & (POLLERR|POLLHUP|POLLNVAL) && !(pfd[i].revents & POLLIN))
+                conn_close(c);
+            else if(c->state == ST_READ && pfd[i].revents & POLLIN)
+                conn_read(c);
+            else if(c->state == ST_WRITE && pfd[i].revents & POLLOUT)
+                conn_write(c);
+        }
+
+        if(opt.stat_interval > 0 && now_ms()-last_stat >= opt.stat_interval*1000L){
+            stat_print(now_ms()-last_stat);
+            last_stat = now_ms();
+        }
+    }
+    stat_print(now_ms()-last_stat);
+    for(i=0;i<MOCK_MAX_CONN;i++)
+        if(conns[i].fd >= 0) conn_close(&conns[i]);
+    close(lfd);
+    return 0;
+}
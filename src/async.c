@@ -11,142 +11,535 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
 #include <plugin.h>
 #include <eventloop.h>
 #include "async.h"
 #include "smemory.h"
+/** max idle events/evsets kept for reuse */
+#define LWQQ_ASYNC_POOL_SIZE 256
+/** default time budget of one drain in ms */
+#define LWQQ_ASYNC_DISPATCH_BUDGET 8
+/** max listeners called in one drain whatever the budget */
+#define LWQQ_ASYNC_DISPATCH_BATCH 64
+/** latency histogram use log2 buckets of ms, last one is 32s and more */
+#define LWQQ_ASYNC_HIST_BUCKETS 16
+/** max callsites tracked, more are counted as "other" */
+#define LWQQ_ASYNC_MAX_CALLSITES 128
+/** completion latency of events and evsets made at one place */
+typedef struct CALLSITE_STAT {
+    char name[64];
+    int live;
+    unsigned long finished;
+    unsigned hist[LWQQ_ASYNC_HIST_BUCKETS];
+    LIST_ENTRY(CALLSITE_STAT) entries;
+}CALLSITE_STAT;
+/** a live event or evset known by registry */
+typedef struct REGISTRY_ENTRY {
+    const char* kind;
+    CALLSITE_STAT* site;
+    long long created;
+    LIST_ENTRY(REGISTRY_ENTRY) entries;
+}REGISTRY_ENTRY;
 typedef struct async_dispatch_data {
     ListenerType type;
-    LwqqClient* client;
-    int handle;
     void* data;
+    TAILQ_ENTRY(async_dispatch_data) entries;
 } async_dispatch_data;
 typedef struct _LwqqAsyncEvset{
     int result;///<it must put first
+    /**@brief lock and cond are only used by blocking evset */
     pthread_mutex_t lock;
     pthread_cond_t cond;
     int cond_waiting;
+    /**@brief atomic in callback evset, it holds one extra ref until
+     * the listener is set */
     int ref_count;
+    int blocking;
+    /**@brief unfinished events of blocking evset, for deadline */
+    LIST_HEAD(,_LwqqAsyncEvent) events;
+    /**@brief monotonic ms, 0 means none */
+    long long deadline;
+    /**@brief evset_expire is cancelling events */
+    int expiring;
+    /**@brief waiter gave up, last finished event frees evset */
+    int orphan;
     EVSET_CALLBACK callback;
     void* data;
     struct{
         const char* __file;
         int __line;
     }debug;
+    SLIST_ENTRY(_LwqqAsyncEvset) free_entries;
+    /**@brief site is NULL when not registered */
+    REGISTRY_ENTRY reg;
 }_LwqqAsyncEvset;
 typedef struct _LwqqAsyncEvent {
     int result;///<it must put first
     LwqqAsyncEvset* host_lock;
     EVENT_CALLBACK callback;
     void* data;
+    void (*cancel)(void* data,int result);
+    void* cancel_data;
+    /**@brief got from evset, monotonic ms. read by who finishes event */
+    long long deadline;
+    /**@brief evset_expire tried cancel once */
+    int expired;
+    LIST_ENTRY(_LwqqAsyncEvent) evset_entries;
     struct{
         const char* __file;
         int __line;
     }debug;
+    SLIST_ENTRY(_LwqqAsyncEvent) free_entries;
+    REGISTRY_ENTRY reg;
 }_LwqqAsyncEvent;
+/**
+ * freed events and evsets are kept in freelists, evsets keep their
+ * mutex and cond initialized. events are created in any thread.
+ */
+static struct {
+    SLIST_HEAD(,_LwqqAsyncEvent) events;
+    SLIST_HEAD(,_LwqqAsyncEvset) evsets;
+    pthread_mutex_t lock;
+    LwqqAsyncPoolStats stats;
+} pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+/**
+ * optional registry of live events and evsets, to find stuck ones and
+ * slow callsites. objects made while it is disabled are not tracked.
+ */
+static struct {
+    int enabled;
+    LIST_HEAD(,REGISTRY_ENTRY) live;
+    LIST_HEAD(,CALLSITE_STAT) sites;
+    int site_count;
+    pthread_mutex_t lock;
+} registry = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
 
-static gboolean timeout_come(void* p);
+static long long now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec*1000LL + ts.tv_nsec/1000000;
+}
+/** need registry lock */
+static CALLSITE_STAT* callsite_get(const char* name)
+{
+    CALLSITE_STAT* st;
+    LIST_FOREACH(st,&registry.sites,entries){
+        if(strcmp(st->name,name)==0) return st;
+    }
+    if(registry.site_count >= LWQQ_ASYNC_MAX_CALLSITES && strcmp(name,"other")!=0)
+        return callsite_get("other");
+    st = s_malloc0(sizeof(*st));
+    strncpy(st->name,name,sizeof(st->name)-1);
+    LIST_INSERT_HEAD(&registry.sites,st,entries);
+    registry.site_count++;
+    return st;
+}
+static void registry_add(REGISTRY_ENTRY* reg,const char* kind,const char* file,int line)
+{
+    char name[64];
+    const char* base;
+    reg->site = NULL;
+    if(!registry.enabled) return;
+    base = file?strrchr(file,'/'):NULL;
+    snprintf(name,sizeof(name),"%s:%d",base?base+1:(file?file:"?"),line);
+    reg->kind = kind;
+    reg->created = now_ms();
+    pthread_mutex_lock(&registry.lock);
+    reg->site = callsite_get(name);
+    reg->site->live++;
+    LIST_INSERT_HEAD(&registry.live,reg,entries);
+    pthread_mutex_unlock(&registry.lock);
+}
+static void hist_add(unsigned* hist,long long ms)
+{
+    int b = 0;
+    while(ms >= 1 && b < LWQQ_ASYNC_HIST_BUCKETS-1){
+        ms /= 2;
+        b++;
+    }
+    hist[b]++;
+}
+static void registry_del(REGISTRY_ENTRY* reg)
+{
+    if(reg->site == NULL) return;
+    long long ms = now_ms() - reg->created;
+    pthread_mutex_lock(&registry.lock);
+    LIST_REMOVE(reg,entries);
+    reg->site->live--;
+    reg->site->finished++;
+    hist_add(reg->site->hist,ms);
+    pthread_mutex_unlock(&registry.lock);
+    reg->site = NULL;
+}
 
+static gboolean dispatch_drain(void* p);
 
+
+/**
+ * queue listener call into client dispatch queue, one source drains
+ * the queue instead of one timer per call. can be called in any thread.
+ */
 void lwqq_async_dispatch(LwqqClient* lc,ListenerType type,void* param)
 {
     if(!lwqq_async_has_listener(lc,type))
         return;
-    async_dispatch_data* data = malloc(sizeof(async_dispatch_data));
+    LwqqAsync* async = lc->async;
+    async_dispatch_data* data = s_malloc0(sizeof(async_dispatch_data));
     data->type = type;
-    data->client = lc;
     data->data = param;
-    data->handle = purple_timeout_add(50,timeout_come,data);
+    pthread_mutex_lock(&async->lock);
+    TAILQ_INSERT_TAIL(&async->queue,data,entries);
+    if(async->drain_event == 0)
+        //next main loop iteration, a burst queued meanwhile goes together
+        async->drain_event = purple_timeout_add(0,dispatch_drain,lc);
+    pthread_mutex_unlock(&async->lock);
 }
 
-static gboolean timeout_come(void* p)
+/**
+ * call queued listeners until queue is empty or budget is used up,
+ * the rest is left to next main loop iteration.
+ */
+static gboolean dispatch_drain(void* p)
 {
-    async_dispatch_data* data = (async_dispatch_data*)p;
-    LwqqClient* lc = data->client;
-    ListenerType type = data->type;
-    if(!lwqq_async_enabled(lc)) return 0;
-    if(lc->async->listener[type]!=NULL)
-        lc->async->listener[type](lc,data->data);
+    LwqqClient* lc = p;
+    LwqqAsync* async = lc->async;
+    async_dispatch_data* data;
+    gint64 deadline = g_get_monotonic_time() + async->budget_ms * 1000;
+    int count = 0;
 
-    free(data);
-    //remote handle;
+    pthread_mutex_lock(&async->lock);
+    async->drain_event = 0;
+    while((data = TAILQ_FIRST(&async->queue))){
+        if(count >= LWQQ_ASYNC_DISPATCH_BATCH || (count > 0 &&
+                    g_get_monotonic_time() >= deadline)){
+            async->drain_event = purple_timeout_add(0,dispatch_drain,lc);
+            break;
+        }
+        TAILQ_REMOVE(&async->queue,data,entries);
+        pthread_mutex_unlock(&async->lock);
+        if(async->listener[data->type]!=NULL)
+            async->listener[data->type](lc,data->data);
+        s_free(data);
+        count++;
+        pthread_mutex_lock(&async->lock);
+    }
+    pthread_mutex_unlock(&async->lock);
     return 0;
 }
 
+void lwqq_async_set_dispatch_budget(LwqqClient* lc,int budget_ms)
+{
+    if(lwqq_async_enabled(lc))
+        lc->async->budget_ms = budget_ms>0?budget_ms:LWQQ_ASYNC_DISPATCH_BUDGET;
+}
 
 void lwqq_async_set(LwqqClient* client,int enabled)
 {
     if(enabled&&!lwqq_async_enabled(client)) {
-        client->async = malloc(sizeof(LwqqAsync));
-        memset(client->async,0,sizeof(LwqqAsync));
+        LwqqAsync* async = s_malloc0(sizeof(LwqqAsync));
+        pthread_mutex_init(&async->lock,NULL);
+        TAILQ_INIT(&async->queue);
+        async->budget_ms = LWQQ_ASYNC_DISPATCH_BUDGET;
+        client->async = async;
     } else if(!enabled&&lwqq_async_enabled(client)) {
-        free(client->async);
+        LwqqAsync* async = client->async;
+        async_dispatch_data* data;
+        //undelivered calls are dropped, their data belongs to client
+        if(async->drain_event)
+            purple_timeout_remove(async->drain_event);
+        while((data = TAILQ_FIRST(&async->queue))){
+            TAILQ_REMOVE(&async->queue,data,entries);
+            s_free(data);
+        }
+        pthread_mutex_destroy(&async->lock);
+        s_free(async);
         client->async=NULL;
     }
 
 }
 LwqqAsyncEvent* lwqq_async_event_new_with_debug(const char* file,int line)
 {
-    LwqqAsyncEvent* event = s_malloc0(sizeof(LwqqAsyncEvent));
+    LwqqAsyncEvent* event;
+    pthread_mutex_lock(&pool.lock);
+    event = SLIST_FIRST(&pool.events);
+    if(event){
+        SLIST_REMOVE_HEAD(&pool.events,free_entries);
+        pool.stats.event_idle--;
+        pool.stats.event_reused++;
+    }else
+        pool.stats.event_alloc++;
+    pool.stats.event_live++;
+    pthread_mutex_unlock(&pool.lock);
+    if(event) memset(event,0,sizeof(*event));
+    else event = s_malloc0(sizeof(*event));
     event->debug.__file = file;
     event->debug.__line = line;
+    registry_add(&event->reg,"event",file,line);
     return event;
 }
-LwqqAsyncEvset* lwqq_async_evset_new_with_debug(const char* file,int line)
+static void event_release(LwqqAsyncEvent* event)
+{
+    registry_del(&event->reg);
+    pthread_mutex_lock(&pool.lock);
+    pool.stats.event_live--;
+    if(pool.stats.event_idle < LWQQ_ASYNC_POOL_SIZE){
+        SLIST_INSERT_HEAD(&pool.events,event,free_entries);
+        pool.stats.event_idle++;
+        event = NULL;
+    }
+    pthread_mutex_unlock(&pool.lock);
+    s_free(event);
+}
+static LwqqAsyncEvset* evset_new(const char* file,int line,int blocking)
 {
-    LwqqAsyncEvset* l = s_malloc0(sizeof(*l));
-    pthread_mutex_init(&l->lock,NULL);
-    pthread_cond_init(&l->cond,NULL);
+    LwqqAsyncEvset* l;
+    pthread_mutex_lock(&pool.lock);
+    l = SLIST_FIRST(&pool.evsets);
+    if(l){
+        SLIST_REMOVE_HEAD(&pool.evsets,free_entries);
+        pool.stats.evset_idle--;
+        pool.stats.evset_reused++;
+    }else
+        pool.stats.evset_alloc++;
+    pool.stats.evset_live++;
+    pthread_mutex_unlock(&pool.lock);
+    if(l){
+        //lock and cond are still initialized
+        l->result = 0;
+        l->cond_waiting = 0;
+        l->ref_count = 0;
+        l->callback = NULL;
+        l->data = NULL;
+        l->deadline = 0;
+        l->expiring = 0;
+        l->orphan = 0;
+    }else{
+        l = s_malloc0(sizeof(*l));
+        pthread_condattr_t attr;
+        pthread_mutex_init(&l->lock,NULL);
+        //deadline must not move with wall clock
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr,CLOCK_MONOTONIC);
+        pthread_cond_init(&l->cond,&attr);
+        pthread_condattr_destroy(&attr);
+    }
+    LIST_INIT(&l->events);
+    l->blocking = blocking;
+    l->ref_count = blocking?0:1;
     l->debug.__file = file;
     l->debug.__line = line;
+    registry_add(&l->reg,"evset",file,line);
     return l;
 }
+LwqqAsyncEvset* lwqq_async_evset_new_with_debug(const char* file,int line)
+{
+    return evset_new(file,line,1);
+}
+LwqqAsyncEvset* lwqq_async_evset_new_callback_with_debug(const char* file,int line)
+{
+    return evset_new(file,line,0);
+}
+static void evset_destroy(LwqqAsyncEvset* l)
+{
+    pthread_mutex_destroy(&l->lock);
+    pthread_cond_destroy(&l->cond);
+    s_free(l);
+}
+static void evset_release(LwqqAsyncEvset* l)
+{
+    registry_del(&l->reg);
+    pthread_mutex_lock(&pool.lock);
+    pool.stats.evset_live--;
+    if(pool.stats.evset_idle < LWQQ_ASYNC_POOL_SIZE){
+        SLIST_INSERT_HEAD(&pool.evsets,l,free_entries);
+        pool.stats.evset_idle++;
+        l = NULL;
+    }
+    pthread_mutex_unlock(&pool.lock);
+    if(l) evset_destroy(l);
+}
+void lwqq_async_pool_stats(LwqqAsyncPoolStats* stats)
+{
+    if(stats == NULL) return;
+    pthread_mutex_lock(&pool.lock);
+    *stats = pool.stats;
+    pthread_mutex_unlock(&pool.lock);
+}
+void lwqq_async_pool_clean()
+{
+    LwqqAsyncEvent* event;
+    LwqqAsyncEvset* l;
+    pthread_mutex_lock(&pool.lock);
+    while((event = SLIST_FIRST(&pool.events))){
+        SLIST_REMOVE_HEAD(&pool.events,free_entries);
+        s_free(event);
+    }
+    while((l = SLIST_FIRST(&pool.evsets))){
+        SLIST_REMOVE_HEAD(&pool.evsets,free_entries);
+        evset_destroy(l);
+    }
+    pool.stats.event_idle = pool.stats.evset_idle = 0;
+    pthread_mutex_unlock(&pool.lock);
+}
+/** last ref of a callback evset is gone */
+static void evset_done(LwqqAsyncEvset* evset)
+{
+    if(evset->callback)
+        evset->callback(evset->result,evset->data);
+    evset_release(evset);
+}
 void lwqq_async_event_finish(LwqqAsyncEvent* event)
 {
+    //cancel hook points to owner which is freed after finish
+    event->cancel = NULL;
+    event->cancel_data = NULL;
     if(event->callback){
         event->callback(event,event->data);
     }
     LwqqAsyncEvset* evset = event->host_lock;
-    if(evset !=NULL){
-        pthread_mutex_lock(&evset->lock);
-        evset->ref_count--;
+    if(evset == NULL){
+    }else if(!evset->blocking){
         //this store evset result.
         //it can only store one error number.
         if(event->result != 0)
             evset->result = event->result;
-        if(event->host_lock->ref_count==0){
+        if(__sync_sub_and_fetch(&evset->ref_count,1)==0)
+            evset_done(evset);
+    }else{
+        int release = 0;
+        pthread_mutex_lock(&evset->lock);
+        LIST_REMOVE(event,evset_entries);
+        evset->ref_count--;
+        if(event->result != 0)
+            evset->result = event->result;
+        if(evset->ref_count==0){
             if(evset->callback)
                 evset->callback(evset->result,evset->data);
             if(evset->cond_waiting)
                 pthread_cond_signal(&evset->cond);
+            release = evset->orphan;
         }
+        //waiter frees evset, do not touch it after unlock
         pthread_mutex_unlock(&evset->lock);
-        if(evset->ref_count == 0 && !evset->cond_waiting)
-            s_free(evset);
+        if(release) evset_release(evset);
     }
-    s_free(event);
+    event_release(event);
 }
 void lwqq_async_evset_add_event(LwqqAsyncEvset* host,LwqqAsyncEvent *handle)
 {
-    pthread_mutex_lock(&host->lock);
     handle->host_lock = host;
+    if(!host->blocking){
+        __sync_add_and_fetch(&host->ref_count,1);
+        return;
+    }
+    pthread_mutex_lock(&host->lock);
     host->ref_count++;
+    __atomic_store_n(&handle->deadline,host->deadline,__ATOMIC_RELAXED);
+    LIST_INSERT_HEAD(&host->events,handle,evset_entries);
     pthread_mutex_unlock(&host->lock);
 }
 
-int lwqq_async_wait(LwqqAsyncEvset* host)
+/** need evset lock */
+static void evset_deadline(LwqqAsyncEvset* host,int timeout_ms)
+{
+    LwqqAsyncEvent* ev;
+    host->deadline = now_ms() + timeout_ms;
+    LIST_FOREACH(ev,&host->events,evset_entries)
+        __atomic_store_n(&ev->deadline,host->deadline,__ATOMIC_RELAXED);
+}
+void lwqq_async_evset_set_deadline(LwqqAsyncEvset* host,int timeout_ms)
+{
+    if(!host->blocking) return;
+    pthread_mutex_lock(&host->lock);
+    evset_deadline(host,timeout_ms);
+    pthread_mutex_unlock(&host->lock);
+}
+int lwqq_async_event_time_left(LwqqAsyncEvent* event)
+{
+    long long deadline = __atomic_load_n(&event->deadline,__ATOMIC_RELAXED);
+    long long left;
+    if(deadline == 0) return -1;
+    left = deadline - now_ms();
+    return left>0?left:0;
+}
+/**
+ * cancel events of a timed out evset which can be cancelled, they
+ * finish with LWQQ_EC_TIMEOUT. it holds one ref of evset, waiter waits
+ * it done. run in main loop.
+ */
+static int evset_expire(void* data)
+{
+    LwqqAsyncEvset* evset = data;
+    LwqqAsyncEvent* ev;
+    for(;;){
+        pthread_mutex_lock(&evset->lock);
+        LIST_FOREACH(ev,&evset->events,evset_entries){
+            if(ev->cancel && !ev->expired) break;
+        }
+        if(ev) ev->expired = 1;
+        pthread_mutex_unlock(&evset->lock);
+        if(ev == NULL) break;
+        //usually it finishes the event, which leaves the list. one which
+        //stays is tried only once and left to orphan evset
+        ev->cancel(ev->cancel_data,LWQQ_EC_TIMEOUT);
+    }
+    pthread_mutex_lock(&evset->lock);
+    if(--evset->ref_count == 0 && evset->callback)
+        evset->callback(evset->result,evset->data);
+    evset->expiring = 0;
+    pthread_cond_signal(&evset->cond);
+    pthread_mutex_unlock(&evset->lock);
+    return 0;
+}
+int lwqq_async_wait_timeout(LwqqAsyncEvset* host,int timeout_ms)
 {
     int ret = 0;
+    struct timespec ts;
     pthread_mutex_lock(&host->lock);
-    if(host->ref_count>0){
-        host->cond_waiting = 1;
-        pthread_cond_wait(&host->cond,&host->lock);
+    if(timeout_ms > 0)
+        evset_deadline(host,timeout_ms);
+    host->cond_waiting = 1;
+    while(host->ref_count>0){
+        if(host->deadline == 0){
+            pthread_cond_wait(&host->cond,&host->lock);
+            continue;
+        }
+        ts.tv_sec = host->deadline / 1000;
+        ts.tv_nsec = host->deadline % 1000 * 1000000;
+        if(pthread_cond_timedwait(&host->cond,&host->lock,&ts) == ETIMEDOUT
+                && host->ref_count>0){
+            host->result = LWQQ_EC_TIMEOUT;
+            host->expiring = 1;
+            host->ref_count++;
+            lwqq_async_timer_add(0,evset_expire,host);
+            while(host->expiring)
+                pthread_cond_wait(&host->cond,&host->lock);
+            if(host->ref_count>0){
+                //events can not be cancelled, leave evset to them
+                host->cond_waiting = 0;
+                host->orphan = 1;
+                pthread_mutex_unlock(&host->lock);
+                return LWQQ_EC_TIMEOUT;
+            }
+            break;
+        }
     }
     pthread_mutex_unlock(&host->lock);
     ret = host->result;
-    s_free(host);
+    evset_release(host);
     return ret;
 }
+int lwqq_async_wait(LwqqAsyncEvset* host)
+{
+    return lwqq_async_wait_timeout(host,0);
+}
 
 void lwqq_async_add_event_listener(LwqqAsyncEvent* event,EVENT_CALLBACK callback,void* data)
 {
@@ -154,8 +547,204 @@ void lwqq_async_add_event_listener(LwqqAsyncEvent* event,EVENT_CALLBACK callback
     event->data = data;
 }
 
+void lwqq_async_event_set_cancel(LwqqAsyncEvent* event,void (*cancel)(void* data,int result),void* data)
+{
+    event->cancel = cancel;
+    event->cancel_data = data;
+}
+int lwqq_async_event_cancel(LwqqAsyncEvent* event)
+{
+    if(!event || !event->cancel) return -1;
+    //it finishes the event
+    event->cancel(event->cancel_data,LWQQ_EC_CANCELED);
+    return 0;
+}
+
 void lwqq_async_add_evset_listener(LwqqAsyncEvset* evset,EVSET_CALLBACK callback,void* data)
 {
     evset->callback = callback;
     evset->data = data;
+    //drop the ref held since creation, all events are added now
+    if(!evset->blocking && __sync_sub_and_fetch(&evset->ref_count,1)==0)
+        evset_done(evset);
+}
+
+void lwqq_async_registry_enable(int enable)
+{
+    registry.enabled = enable;
+}
+void lwqq_async_event_set_site(LwqqAsyncEvent* event,const char* name)
+{
+    if(event == NULL || event->reg.site == NULL || name == NULL) return;
+    pthread_mutex_lock(&registry.lock);
+    event->reg.site->live--;
+    event->reg.site = callsite_get(name);
+    event->reg.site->live++;
+    pthread_mutex_unlock(&registry.lock);
+}
+/** upper bound of bucket where p of values fall in */
+static long hist_percentile(const unsigned* hist,double p)
+{
+    unsigned long total = 0,sum = 0;
+    int b;
+    for(b=0;b<LWQQ_ASYNC_HIST_BUCKETS;b++) total += hist[b];
+    if(total == 0) return -1;
+    for(b=0;b<LWQQ_ASYNC_HIST_BUCKETS;b++){
+        sum += hist[b];
+        if(sum >= total*p) break;
+    }
+    return 1L<<b;
+}
+void lwqq_async_registry_dump(FILE* f,int stuck_ms)
+{
+    REGISTRY_ENTRY* reg;
+    CALLSITE_STAT* st;
+    long long now = now_ms();
+    int stuck = 0;
+
+    pthread_mutex_lock(&registry.lock);
+    if(!registry.enabled)
+        fprintf(f,"async registry is disabled, set LWQQ_ASYNC_REGISTRY to enable\n");
+    fprintf(f,"events and evsets alive longer than %d ms\n",stuck_ms);
+    LIST_FOREACH(reg,&registry.live,entries){
+        if(now - reg->created < stuck_ms) continue;
+        fprintf(f,"  %s %-32s %lld ms\n",reg->kind,reg->site->name,now - reg->created);
+        stuck++;
+    }
+    fprintf(f,"%d stuck\n",stuck);
+    fprintf(f,"\ncompletion latency by callsite (ms, bucket upper bound)\n");
+    fprintf(f,"  %-32s %8s %6s %8s %8s %8s\n","callsite","finished","live","p50","p90","p99");
+    LIST_FOREACH(st,&registry.sites,entries){
+        //renamed by lwqq_async_event_set_site
+        if(st->finished == 0 && st->live == 0) continue;
+        fprintf(f,"  %-32s %8lu %6d %8ld %8ld %8ld\n",st->name,st->finished,st->live,
+                hist_percentile(st->hist,0.5),hist_percentile(st->hist,0.9),
+                hist_percentile(st->hist,0.99));
+    }
+    pthread_mutex_unlock(&registry.lock);
+}
+
+typedef struct async_then_data {
+    THEN_CALLBACK callback;
+    void* data;
+    LwqqAsyncEvent* ret;
+} async_then_data;
+typedef struct async_any_data {
+    LwqqAsyncEvent* ret;
+    int remaining;
+    int done;
+} async_any_data;
+typedef struct async_later_data {
+    LwqqAsyncEvent* event;
+    int result;
+} async_later_data;
+static int later_come(void* p)
+{
+    async_later_data* d = p;
+    lwqq_async_event_set_result(d->event,d->result);
+    lwqq_async_event_finish(d->event);
+    s_free(d);
+    return 0;
+}
+/**
+ * a event which finishes with result in next main loop iteration,
+ * so caller can still add listener to it.
+ */
+static LwqqAsyncEvent* event_finish_later(int result)
+{
+    async_later_data* d = s_malloc0(sizeof(*d));
+    d->event = lwqq_async_event_new();
+    d->result = result;
+    lwqq_async_timer_add(0,later_come,d);
+    return d->event;
+}
+static void then_forward(LwqqAsyncEvent* event,void* data)
+{
+    LwqqAsyncEvent* ret = data;
+    lwqq_async_event_set_result(ret,lwqq_async_event_get_result(event));
+    lwqq_async_event_finish(ret);
+}
+static void then_come(LwqqAsyncEvent* event,void* data)
+{
+    async_then_data* t = data;
+    LwqqAsyncEvent* ret = t->ret;
+    int result = lwqq_async_event_get_result(event);
+    LwqqAsyncEvent* next = t->callback(result,t->data);
+    s_free(t);
+    if(next == NULL){
+        lwqq_async_event_set_result(ret,result);
+        lwqq_async_event_finish(ret);
+    }else
+        lwqq_async_add_event_listener(next,then_forward,ret);
+}
+LwqqAsyncEvent* lwqq_async_then(LwqqAsyncEvent* event,THEN_CALLBACK callback,void* data)
+{
+    async_then_data* t = s_malloc0(sizeof(*t));
+    t->callback = callback;
+    t->data = data;
+    t->ret = lwqq_async_event_new();
+    if(event == NULL)
+        event = event_finish_later(LWQQ_EC_ERROR);
+    lwqq_async_add_event_listener(event,then_come,t);
+    return t->ret;
+}
+static void all_come(int result,void* data)
+{
+    LwqqAsyncEvent* ret = data;
+    lwqq_async_event_set_result(ret,result);
+    lwqq_async_event_finish(ret);
+}
+LwqqAsyncEvent* lwqq_async_all(LwqqAsyncEvent** events,int count)
+{
+    int i,added = 0;
+    int result = 0;
+    for(i=0;i<count;i++){
+        if(events[i] == NULL) result = LWQQ_EC_ERROR;
+        else added++;
+    }
+    if(added == 0)
+        return event_finish_later(result);
+    LwqqAsyncEvent* ret = lwqq_async_event_new();
+    LwqqAsyncEvset* set = lwqq_async_evset_new_callback();
+    set->result = result;
+    for(i=0;i<count;i++){
+        if(events[i]) lwqq_async_evset_add_event(set,events[i]);
+    }
+    lwqq_async_add_evset_listener(set,all_come,ret);
+    return ret;
+}
+static void any_come(LwqqAsyncEvent* event,void* data)
+{
+    async_any_data* a = data;
+    if(__sync_bool_compare_and_swap(&a->done,0,1)){
+        lwqq_async_event_set_result(a->ret,lwqq_async_event_get_result(event));
+        lwqq_async_event_finish(a->ret);
+    }
+    if(__sync_sub_and_fetch(&a->remaining,1)==0)
+        s_free(a);
+}
+LwqqAsyncEvent* lwqq_async_any(LwqqAsyncEvent** events,int count)
+{
+    int i,added = 0;
+    for(i=0;i<count;i++)
+        if(events[i]) added++;
+    if(added == 0)
+        return event_finish_later(LWQQ_EC_ERROR);
+    async_any_data* a = s_malloc0(sizeof(*a));
+    a->ret = lwqq_async_event_new();
+    a->remaining = added;
+    LwqqAsyncEvent* ret = a->ret;
+    for(i=0;i<count;i++){
+        if(events[i]) lwqq_async_add_event_listener(events[i],any_come,a);
+    }
+    return ret;
+}
+
+int lwqq_async_timer_add(int ms,TIMER_CALLBACK callback,void* data)
+{
+    return purple_timeout_add(ms,(GSourceFunc)callback,data);
+}
+void lwqq_async_timer_remove(int timer)
+{
+    if(timer) purple_timeout_remove(timer);
 }
@@ -15,13 +15,11 @@ do{pthread_t th;\
 }while(0)
 
 
-static void* _background_login(void* data)
+static void login_back(LwqqAsyncEvent* event,void* data)
 {
     qq_account* ac=(qq_account*)data;
     LwqqClient* lc = ac->qq;
-    LwqqErrorCode err;
-
-    lwqq_login(lc, &err);
+    LwqqErrorCode err = lwqq_async_event_get_result(event);
 
     if (err == LWQQ_EC_LOGIN_NEED_VC) {
         lwqq_async_set_error(lc,VERIFY_COME,err);
@@ -34,56 +32,74 @@ static void* _background_login(void* data)
         lwqq_async_set_error(lc,LOGIN_COMPLETE,err);
         lwqq_async_dispatch(lc,LOGIN_COMPLETE,NULL);
     }
-    return NULL;
 }
 
 
 void background_login(qq_account* ac)
 {
-    START_THREAD(_background_login,ac);
+    LwqqClient* lc = ac->qq;
+    LwqqAsyncEvent* event = lwqq_login_async(lc);
+    if(event == NULL){
+        LwqqErrorCode err = LWQQ_EC_ERROR;
+        lwqq_async_set_error(lc,LOGIN_COMPLETE,err);
+        lwqq_async_dispatch(lc,LOGIN_COMPLETE,NULL);
+        return;
+    }
+    lwqq_async_add_event_listener(event,login_back,ac);
 }
-static void* _background_friends_info(void* data)
+/** friends and groups are known, ask what depends on them */
+static LwqqAsyncEvent* friends_detail(int result,void* data)
 {
+    //failed or canceled by qq_close, client may be going away
+    if(result != 0) return NULL;
     qq_account* ac=(qq_account*)data;
-    LwqqErrorCode err;
     LwqqClient* lc=ac->qq;
-
-    LwqqAsyncEvset* lock = lwqq_async_evset_new();
-    LwqqAsyncEvent* event;
-    event = lwqq_info_get_friends_info(lc,&err);
-    lwqq_async_evset_add_event(lock,event);
-    event = lwqq_info_get_group_name_list(ac->qq,&err);
-    lwqq_async_evset_add_event(lock,event);
-    lwqq_async_wait(lock);
-
-    lock = lwqq_async_evset_new();
-    event = lwqq_info_get_online_buddies(ac->qq,&err);
-    lwqq_async_evset_add_event(lock,event);
-    lwqq_async_wait(lock);
-
-
-    lwqq_info_get_friend_detail_info(lc,lc->myself,&err);
-
-
-    //lwqq_info_get_all_friend_qqnumbers(lc,&err);
-    lock = lwqq_async_evset_new();
+    LwqqErrorCode err;
     LwqqBuddy* buddy;
-    LIST_FOREACH(buddy,&ac->qq->friends,entries){
-        event = lwqq_info_get_friend_qqnumber(lc,buddy->uin);
-        lwqq_async_evset_add_event(lock,event);
-    }
     LwqqGroup* group;
-    LIST_FOREACH(group,&ac->qq->groups,entries) {
-        event = lwqq_info_get_friend_qqnumber(lc,group->code);
-        lwqq_async_evset_add_event(lock,event);
-    }
-    lwqq_async_add_evset_listener(lock,qq_set_basic_info,ac);
+    int count = 1;
+    LIST_FOREACH(buddy,&lc->friends,entries) count++;
+    LIST_FOREACH(group,&lc->groups,entries) count++;
 
-    return NULL;
+    LwqqAsyncEvent** events = s_malloc0(sizeof(LwqqAsyncEvent*)*count);
+    int i = 0;
+    events[i++] = lwqq_info_get_online_buddies(lc,&err);
+    //lwqq_info_get_all_friend_qqnumbers(lc,&err);
+    LIST_FOREACH(buddy,&lc->friends,entries)
+        events[i++] = lwqq_info_get_friend_qqnumber(lc,buddy->uin);
+    LIST_FOREACH(group,&lc->groups,entries)
+        events[i++] = lwqq_info_get_friend_qqnumber(lc,group->code);
+    LwqqAsyncEvent* ev = lwqq_async_all(events,count);
+    s_free(events);
+    return ev;
 }
+static void friends_info_done(LwqqAsyncEvent* event,void* data)
+{
+    qq_account* ac = data;
+    int result = lwqq_async_event_get_result(event);
+    //canceled when account closes, ac is freed right after
+    if(result == LWQQ_EC_CANCELED) return;
+    if(result != 0){
+        purple_connection_error_reason(ac->gc,PURPLE_CONNECTION_ERROR_NETWORK_ERROR,"获取好友信息失败");
+        return;
+    }
+    qq_set_basic_info(result,ac);
+}
+/**
+ * friends, groups and my detail go together, then online buddies and
+ * qqnumbers which need the lists. runs in main loop, no thread waits.
+ */
 void background_friends_info(qq_account* ac)
 {
-    START_THREAD(_background_friends_info,ac);
+    LwqqErrorCode err;
+    LwqqClient* lc=ac->qq;
+    LwqqAsyncEvent* events[3];
+
+    events[0] = lwqq_info_get_friends_info(lc,&err);
+    events[1] = lwqq_info_get_group_name_list(lc,&err);
+    events[2] = lwqq_info_get_friend_detail_info(lc,lc->myself,&err);
+    LwqqAsyncEvent* ev = lwqq_async_then(lwqq_async_all(events,3),friends_detail,ac);
+    lwqq_async_add_event_listener(ev,friends_info_done,ac);
 }
 static int msg_check_repeat = 1;
 static gboolean msg_check(void* data)
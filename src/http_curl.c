@@ -5,34 +5,228 @@
 #include <plugin.h>
 #include <eventloop.h>
 #include <stdlib.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <pthread.h>
 #include "async.h"
 #include "smemory.h"
 #include "http.h"
 #include "logger.h"
 
 #define LWQQ_HTTP_USER_AGENT "Mozilla/5.0 (X11; Linux x86_64; rv:10.0) Gecko/20100101 Firefox/10.0"
+/** max number of idle easy handles kept in pool */
+#define LWQQ_HTTP_POOL_SIZE 8
+/** idle handle older than this (seconds) would be cleaned */
+#define LWQQ_HTTP_POOL_EXPIRE 60
+/** output size each inflate round */
+#define LWQQ_INFLATE_CHUNK 16 * 1024
+/** first allocation of response buffer, then grow double */
+#define LWQQ_HTTP_RESP_INIT 4 * 1024
+/** default max size of response body */
+#define LWQQ_HTTP_RESP_MAX 16 * 1024 * 1024
+/** response buffer not larger than this is recycled with easy handle */
+#define LWQQ_HTTP_RESP_KEEP 64 * 1024
+/** hash slots of response header table, must be power of 2 */
+#define LWQQ_HTTP_HEADER_SLOTS 64
+/** size of one arena block which hold header and cookie strings */
+#define LWQQ_HTTP_ARENA_BLOCK 2048
+/** max running background requests, and max of them to one host */
+#define LWQQ_HTTP_MAX_RUNNING 16
+#define LWQQ_HTTP_MAX_PER_HOST 4
+/** connection caps used when pipelining/multiplexing enabled */
+#define LWQQ_HTTP_MAX_HOST_CONNECTIONS 4
+#define LWQQ_HTTP_MAX_TOTAL_CONNECTIONS 16
+/** curl_mime_* appeared in 7.56.0, older libcurl use curl_formadd */
+#if LIBCURL_VERSION_NUM >= 0x073800
+#define LWQQ_HTTP_MIME 1
+#endif
+/** timing histogram use log2 buckets of ms, last one is 16s and more */
+#define LWQQ_HTTP_HIST_BUCKETS 16
+/** histograms keep current and last window of this seconds */
+#define LWQQ_HTTP_HIST_WINDOW 600
+/** max endpoints tracked, more are counted as "other" */
+#define LWQQ_HTTP_MAX_ENDPOINTS 64
+/**
+ * global retry budget: a retry costs one token, every finished request
+ * earns LWQQ_HTTP_RETRY_RATIO token, never more than LWQQ_HTTP_RETRY_BUDGET.
+ * so retries are at most ~10% of traffic when server is down.
+ */
+#define LWQQ_HTTP_RETRY_BUDGET 10.0
+#define LWQQ_HTTP_RETRY_RATIO 0.1
+/** sync request gives up after this ms */
+#define LWQQ_HTTP_SYNC_TIMEOUT 60000
+/** sync request in main loop freezes UI, e.g. logout on close, keep it short */
+#define LWQQ_HTTP_INPLACE_TIMEOUT 3000
 
 static int lwqq_http_do_request(LwqqHttpRequest *request, int method, char *body);
+static void global_setup();
 static void lwqq_http_set_header(LwqqHttpRequest *request, const char *name,
                                  const char *value);
 static void lwqq_http_set_default_header(LwqqHttpRequest *request);
+static void lwqq_http_set_header_template(LwqqHttpRequest* request,
+        LwqqHttpHeaderClass cls);
+static void lwqq_http_set_cookie_header(LwqqHttpRequest* request,
+        LwqqCookieHeader* h);
 static const char *lwqq_http_get_header(LwqqHttpRequest *request, const char *name);
 static char *lwqq_http_get_cookie(LwqqHttpRequest *request, const char *name);
 static void lwqq_http_add_form(LwqqHttpRequest* request,LWQQ_FORM form,
         const char* name,const char* value);
 static void lwqq_http_add_file_content(LwqqHttpRequest* request,const char* name,
         const char* filename,const void* data,size_t size,const char* extension);
-
+static int lwqq_http_add_file_fd(LwqqHttpRequest* request,const char* name,
+        const char* filename,int fd,size_t size,const char* extension);
+static void lwqq_http_set_progress(LwqqHttpRequest* request,
+        LwqqProgressFunc func,void* data);
+static void lwqq_http_set_single_flight(LwqqHttpRequest* request,const char* key);
+static void item_cancel(void* data,int result);
+static int sync_back(LwqqHttpRequest* request,void* data);
+static void stream_free_all(LwqqHttpRequest* request);
+static void inflate_end(LwqqHttpRequest* request);
+static void resp_reset(LwqqHttpRequest* request);
+
+typedef struct CURLPOOL {
+    CURL* easy;
+    /**@brief recycled response buffer */
+    char* buf;
+    size_t buf_cap;
+    time_t idle_since;
+    LIST_ENTRY(CURLPOOL) entries;
+}CURLPOOL;
+/**
+ * upload source read by libcurl when it sends the body, so the content
+ * never has to be copied into the form. fd -1 means data is memory.
+ */
+typedef struct HTTP_STREAM {
+    int fd;
+    const char* data;
+    size_t size;
+    size_t offset;
+    /**@brief data is mmap of fd, only without mime api */
+    int mapped;
+    struct HTTP_STREAM* next;
+}HTTP_STREAM;
+typedef enum {
+    T_QUEUE,
+    T_DNS,
+    T_CONNECT,
+    T_TLS,
+    T_FIRST_BYTE,
+    T_TOTAL,
+    T_LENGTH
+}TIMING;
+static const char* timing_names[T_LENGTH] = {
+    "queue","dns","connect","tls","first byte","total"
+};
+/** timing statistics of one endpoint, e.g. poll2 */
+typedef struct ENDPOINT_STAT {
+    char name[48];
+    time_t window_start;
+    /**@brief [0] is current window, [1] is last window */
+    unsigned hist[2][T_LENGTH][LWQQ_HTTP_HIST_BUCKETS];
+    unsigned long count;
+    unsigned long failed;
+    double bytes_up;
+    double bytes_down;
+    LIST_ENTRY(ENDPOINT_STAT) entries;
+}ENDPOINT_STAT;
+typedef struct RETRY_POLICY {
+    int max_retry;
+    int base_ms;
+    int max_ms;
+}RETRY_POLICY;
+typedef struct HOST_ITEM {
+    char* host;
+    int running;
+    LIST_ENTRY(HOST_ITEM) entries;
+}HOST_ITEM;
+/** accounting of one owner (account) on the shared engine */
+typedef struct OWNER_ITEM {
+    void* owner;
+    /**@brief 0 means only the global limit applies */
+    int max_running;
+    LwqqHttpStats stats;
+    LIST_ENTRY(OWNER_ITEM) entries;
+}OWNER_ITEM;
 typedef struct GLOBAL {
     CURLM* multi;
     CURLSH* share;
-    pthread_mutex_t share_lock[2];
+    /**@brief one lock per curl_lock_data, shared access can go together */
+    pthread_rwlock_t share_lock[CURL_LOCK_DATA_LAST];
     //struct ev_loop* loop;
     int still_running;
     int timer_event;
+    /**@brief idle easy handles, most recently used first */
     LIST_HEAD(,CURLPOOL) easy_pool;
+    pthread_mutex_t pool_lock;
+    int pool_size;
+    int pool_max;
+    int pool_expire;
+    /**@brief handles wait to be added to multi on next loop iteration */
+    TAILQ_HEAD(,D_ITEM) submit;
+    pthread_mutex_t submit_lock;
+    int submit_event;
+    /**@brief scheduler. only touched in main loop */
+    TAILQ_HEAD(,D_ITEM) waiting[LWQQ_HTTP_PRIO_LENGTH];
+    LIST_HEAD(,HOST_ITEM) hosts;
+    LIST_HEAD(,OWNER_ITEM) owners;
+    int running;
+    int max_running;
+    int max_per_host;
+    LwqqHttpStats stats;
+    /**@brief pipelining/multiplexing, opt-in */
+    int multiplex;
+    long max_host_connections;
+    long max_total_connections;
+    /**@brief timing statistics, requests finish in any thread */
+    LIST_HEAD(,ENDPOINT_STAT) endpoints;
+    int endpoint_count;
+    pthread_mutex_t stat_lock;
+    /**@brief retry. only touched in main loop */
+    RETRY_POLICY retry[LWQQ_HTTP_PRIO_LENGTH];
+    double retry_tokens;
+    /**@brief local stand-in server and response recording, for test */
+    char* base_url;
+    char* record_dir;
+    /**@brief single flight requests by key, requests finish in any thread */
+    LIST_HEAD(,D_ITEM) flights;
+    pthread_mutex_t flight_lock;
+    /**@brief unfinished async items, for cancel */
+    LIST_HEAD(,D_ITEM) items;
+    pthread_mutex_t item_lock;
+    /**@brief immutable header lists shared by requests */
+    struct curl_slist* header_tmpl[LWQQ_HTTP_HEADER_LENGTH];
+    /**@brief attached accounts, engine is torn down when last one leaves */
+    int clients;
+    /**@brief thread of main loop, known after lwqq_http_global_init */
+    pthread_t main_thread;
+    int main_known;
 }GLOBAL;
-GLOBAL global;
+GLOBAL global = {
+    .pool_lock = PTHREAD_MUTEX_INITIALIZER,
+    .pool_max = LWQQ_HTTP_POOL_SIZE,
+    .pool_expire = LWQQ_HTTP_POOL_EXPIRE,
+    .submit = TAILQ_HEAD_INITIALIZER(global.submit),
+    .submit_lock = PTHREAD_MUTEX_INITIALIZER,
+    .max_running = LWQQ_HTTP_MAX_RUNNING,
+    .max_per_host = LWQQ_HTTP_MAX_PER_HOST,
+    .max_host_connections = LWQQ_HTTP_MAX_HOST_CONNECTIONS,
+    .max_total_connections = LWQQ_HTTP_MAX_TOTAL_CONNECTIONS,
+    .stat_lock = PTHREAD_MUTEX_INITIALIZER,
+    .flight_lock = PTHREAD_MUTEX_INITIALIZER,
+    .item_lock = PTHREAD_MUTEX_INITIALIZER,
+    //send is not idempotent, poll loop retry itself.
+    .retry = {
+        [LWQQ_HTTP_PRIO_SEND]   = {0,0,0},
+        [LWQQ_HTTP_PRIO_POLL]   = {0,0,0},
+        [LWQQ_HTTP_PRIO_ROSTER] = {3,500,8000},
+        [LWQQ_HTTP_PRIO_AVATAR] = {2,1000,8000},
+        [LWQQ_HTTP_PRIO_BULK]   = {3,1000,16000},
+    },
+    .retry_tokens = LWQQ_HTTP_RETRY_BUDGET,
+};
 
 typedef struct S_ITEM {
     /**@brief 全局事件循环*/
@@ -43,25 +237,360 @@ typedef struct S_ITEM {
     int evset;
     int ev;
 }S_ITEM;
+/** where a D_ITEM is, so it can be taken out when cancelled */
+typedef enum {
+    DI_NEW,         ///< prepared, not submitted yet
+    DI_SUBMIT,      ///< in submit queue
+    DI_WAITING,     ///< in waiting queue of scheduler
+    DI_RUNNING,     ///< in multi
+    DI_RETRY,       ///< retry timer pending
+    DI_FOLLOWER     ///< waits response of another request
+}DI_STATE;
 typedef struct D_ITEM{
     LwqqAsyncCallback callback;
     LwqqHttpRequest* req;
     LwqqAsyncEvent* event;
     void* data;
+    TAILQ_ENTRY(D_ITEM) entries;
+    /**@brief host slot taken while running */
+    HOST_ITEM* host;
+    /**@brief accounting of req->owner, set when queued */
+    OWNER_ITEM* account;
+    /**@brief submit time, then time waited in queue */
+    double queue_ms;
+    /**@brief result of last transfer and retried times */
+    CURLcode result;
+    int attempt;
+    /**@brief 0 is GET, only it is retried unless request is idempotent */
+    int method;
+    /**@brief same requests waiting for this one, linked by entries */
+    TAILQ_HEAD(,D_ITEM) followers;
+    LIST_ENTRY(D_ITEM) flight_entries;
+    int in_flight;
+    struct D_ITEM* leader;
+    /**@brief every unfinished item is in global.items */
+    DI_STATE state;
+    int prio;
+    int retry_timer;
+    LIST_ENTRY(D_ITEM) item_entries;
 }D_ITEM;
 /* For async request */
 static LwqqAsyncEvent* lwqq_http_do_request_async(struct LwqqHttpRequest *request, int method,
         char *body, LwqqAsyncCallback callback,
                                       void *data);
+static void submit_handle(GLOBAL* g,D_ITEM* di);
 
-#define slist_free_all(list) \
-while(list!=NULL){ \
-    void *ptr = list; \
-    list = list->next; \
-    s_free(ptr); \
-}
 #define slist_append(list,node) \
 (node->next = list,node)
+
+typedef struct ARENA {
+    struct ARENA* next;
+    size_t size;
+    size_t used;
+    char data[];
+}ARENA;
+typedef struct HEADER_SLOT {
+    char* name;
+    char* value;
+    unsigned hash;
+}HEADER_SLOT;
+/**
+ * response header of one request.
+ * open addressing hash table, name is case insensitive.
+ * all strings and cookie nodes live in arena, freed at once.
+ */
+typedef struct HEADER_TABLE {
+    ARENA* arena;
+    int count;
+    HEADER_SLOT slot[LWQQ_HTTP_HEADER_SLOTS];
+}HEADER_TABLE;
+
+static void* arena_alloc(HEADER_TABLE* t,size_t size)
+{
+    ARENA* a = t->arena;
+    //keep pointer aligned for cookie node
+    size = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+    if(a == NULL || a->size - a->used < size){
+        size_t bsize = size > LWQQ_HTTP_ARENA_BLOCK?size:LWQQ_HTTP_ARENA_BLOCK;
+        a = s_malloc(sizeof(*a)+bsize);
+        a->size = bsize;
+        a->used = 0;
+        a->next = t->arena;
+        t->arena = a;
+    }
+    void* ptr = a->data + a->used;
+    a->used += size;
+    return ptr;
+}
+static char* arena_strndup(HEADER_TABLE* t,const char* str,size_t len)
+{
+    char* ret = arena_alloc(t,len+1);
+    memcpy(ret,str,len);
+    ret[len] = '\0';
+    return ret;
+}
+static unsigned header_hash(const char* name,size_t len)
+{
+    //FNV-1a on lower case
+    unsigned h = 2166136261u;
+    size_t i;
+    for(i=0;i<len;i++){
+        h ^= (unsigned char)tolower((unsigned char)name[i]);
+        h *= 16777619u;
+    }
+    return h;
+}
+static HEADER_SLOT* header_find(HEADER_TABLE* t,const char* name,size_t len,unsigned hash)
+{
+    unsigned i = hash & (LWQQ_HTTP_HEADER_SLOTS-1);
+    HEADER_SLOT* slot;
+    while((slot = &t->slot[i])->name){
+        if(slot->hash == hash && strncasecmp(slot->name,name,len)==0
+                && slot->name[len] == '\0')
+            return slot;
+        i = (i+1) & (LWQQ_HTTP_HEADER_SLOTS-1);
+    }
+    //empty slot for insert
+    return slot;
+}
+static void header_put(HEADER_TABLE* t,const char* name,size_t nlen,
+        const char* value,size_t vlen)
+{
+    unsigned hash = header_hash(name,nlen);
+    HEADER_SLOT* slot = header_find(t,name,nlen,hash);
+    if(slot->name == NULL){
+        //keep load factor under 3/4
+        if(t->count >= LWQQ_HTTP_HEADER_SLOTS*3/4){
+            lwqq_log(LOG_WARNING,"Too many headers, drop %.*s\n",(int)nlen,name);
+            return;
+        }
+        slot->name = arena_strndup(t,name,nlen);
+        slot->hash = hash;
+        t->count++;
+    }
+    slot->value = arena_strndup(t,value,vlen);
+}
+static const char* header_get(HEADER_TABLE* t,const char* name)
+{
+    if(t == NULL) return NULL;
+    size_t len = strlen(name);
+    return header_find(t,name,len,header_hash(name,len))->value;
+}
+/** forget all headers, but keep arena memory for strings */
+static void header_clear(HEADER_TABLE* t)
+{
+    memset(t->slot,0,sizeof(t->slot));
+    t->count = 0;
+}
+/** drop everything except the first arena block */
+static void header_reset(HEADER_TABLE* t)
+{
+    ARENA* a = t->arena;
+    header_clear(t);
+    if(a == NULL) return;
+    while(a->next){
+        ARENA* next = a->next->next;
+        s_free(a->next);
+        a->next = next;
+    }
+    a->used = 0;
+}
+static void header_free(HEADER_TABLE* t)
+{
+    if(t == NULL) return;
+    ARENA* a = t->arena;
+    while(a){
+        ARENA* next = a->next;
+        s_free(a);
+        a = next;
+    }
+    s_free(t);
+}
+static const char* trim(const char* str,const char** end)
+{
+    while(str<*end && (*str==' '||*str=='\t')) str++;
+    while(*end>str && ((*end)[-1]==' '||(*end)[-1]=='\t')) (*end)--;
+    return str;
+}
+/**
+ * parse a Set-Cookie value.
+ * e.g. name="value"; Path=/; Domain=qq.com; Expires=Thu, 01-Jan-1970 00:00:00 GMT
+ */
+static struct cookie_list* parse_cookie(HEADER_TABLE* t,const char* str,size_t len)
+{
+    const char* end = str+len;
+    const char* semi = memchr(str,';',len);
+    const char* eq;
+    const char *name,*name_end,*value,*value_end;
+    struct cookie_list* node;
+
+    if(semi == NULL) semi = end;
+    eq = memchr(str,'=',semi-str);
+    if(eq == NULL) return NULL;
+    name_end = eq;
+    name = trim(str,&name_end);
+    if(name == name_end) return NULL;
+    value_end = semi;
+    value = trim(eq+1,&value_end);
+    if(value_end-value >= 2 && *value == '"' && value_end[-1] == '"'){
+        value++;
+        value_end--;
+    }
+    node = arena_alloc(t,sizeof(*node));
+    node->name = arena_strndup(t,name,name_end-name);
+    node->value = arena_strndup(t,value,value_end-value);
+    node->domain = NULL;
+    node->path = NULL;
+
+    //attributes
+    while(semi < end){
+        const char* attr = semi+1;
+        const char *attr_end,*val,*val_end;
+        semi = memchr(attr,';',end-attr);
+        if(semi == NULL) semi = end;
+        eq = memchr(attr,'=',semi-attr);
+        if(eq == NULL) continue;
+        attr_end = eq;
+        attr = trim(attr,&attr_end);
+        val_end = semi;
+        val = trim(eq+1,&val_end);
+        if(attr_end-attr == 6 && strncasecmp(attr,"Domain",6)==0)
+            node->domain = arena_strndup(t,val,val_end-val);
+        else if(attr_end-attr == 4 && strncasecmp(attr,"Path",4)==0)
+            node->path = arena_strndup(t,val,val_end-val);
+    }
+    return node;
+}
+/** header lines every template begins with */
+#define DEFAULT_HEADERS \
+    "User-Agent: " LWQQ_HTTP_USER_AGENT, \
+    "Accept: */*,text/html, application/xml;q=0.9, " \
+        "application/xhtml+xml, image/png, image/jpeg, " \
+        "image/gif, image/x-xbitmap,;q=0.1", \
+    "Accept-Language: en-US,zh-CN,zh;q=0.9,en;q=0.8", \
+    "Accept-Charset: GBK, utf-8, utf-16, *;q=0.1", \
+    "Accept-Encoding: deflate, gzip, x-gzip, identity, *;q=0", \
+    "Connection: Keep-Alive"
+#define FORM_HEADERS \
+    "Content-Transfer-Encoding: binary", \
+    "Content-type: application/x-www-form-urlencoded"
+static const char* const header_spec[LWQQ_HTTP_HEADER_LENGTH][12] = {
+    [LWQQ_HTTP_HEADER_DEFAULT] = {DEFAULT_HEADERS,NULL},
+    [LWQQ_HTTP_HEADER_POLL] = {DEFAULT_HEADERS,
+        "Referer: http://d.web2.qq.com/proxy.html?v=20101025002",FORM_HEADERS,NULL},
+    [LWQQ_HTTP_HEADER_SEND] = {DEFAULT_HEADERS,
+        "Referer: http://d.web2.qq.com/proxy.html?v=20101025002",FORM_HEADERS,NULL},
+    [LWQQ_HTTP_HEADER_INFO] = {DEFAULT_HEADERS,
+        "Referer: http://s.web2.qq.com/proxy.html?v=20101025002",FORM_HEADERS,NULL},
+    [LWQQ_HTTP_HEADER_CHANGE] = {DEFAULT_HEADERS,"Origin: http://s.web2.qq.com",
+        "Referer: http://s.web2.qq.com/proxy.html?v=20110412001&callback=0&id=3",NULL},
+    [LWQQ_HTTP_HEADER_UPLOAD] = {DEFAULT_HEADERS,"Origin: http://web2.qq.com",
+        "Referer: http://web2.qq.com/",NULL},
+};
+/**
+ * templates are built once and never changed, request->header is a list of
+ * private nodes whose tail links to request->header_tmpl.
+ */
+static void header_tmpl_build(GLOBAL* g)
+{
+    int i,j;
+    for(i=0;i<LWQQ_HTTP_HEADER_LENGTH;i++){
+        if(g->header_tmpl[i]) continue;
+        for(j=0;header_spec[i][j];j++)
+            g->header_tmpl[i] = curl_slist_append(g->header_tmpl[i],header_spec[i][j]);
+    }
+}
+static void header_tmpl_free(GLOBAL* g)
+{
+    int i;
+    for(i=0;i<LWQQ_HTTP_HEADER_LENGTH;i++){
+        curl_slist_free_all(g->header_tmpl[i]);
+        g->header_tmpl[i] = NULL;
+    }
+}
+/** node and its line are one block, so a node costs one malloc */
+static struct curl_slist* hlist_node(const char* name,size_t name_len,const char* value)
+{
+    size_t value_len = value?strlen(value):0;
+    struct curl_slist* node = s_malloc(sizeof(*node)+name_len+value_len+3);
+    char* opt = (char*)(node+1);
+    memcpy(opt,name,name_len);
+    if(value){
+        opt[name_len] = ':';
+        //need a blank space
+        opt[name_len+1] = ' ';
+        strcpy(opt+name_len+2,value);
+    }else
+        opt[name_len] = '\0';
+    node->data = opt;
+    node->next = NULL;
+    return node;
+}
+static int hlist_match(const char* line,const char* name,size_t name_len)
+{
+    return strncasecmp(line,name,name_len)==0 && line[name_len]==':';
+}
+/** @return last private node, NULL if there is none */
+static struct curl_slist* hlist_private_tail(LwqqHttpRequest* request)
+{
+    struct curl_slist* node = request->header;
+    struct curl_slist* tail = NULL;
+    while(node && node != request->header_tmpl){
+        tail = node;
+        node = node->next;
+    }
+    return tail;
+}
+/**
+ * template is shared, a header it already has can't be replaced in place.
+ * copy template into private nodes without that header.
+ */
+static void hlist_fork(LwqqHttpRequest* request,const char* name,size_t name_len)
+{
+    struct curl_slist* tail = hlist_private_tail(request);
+    struct curl_slist* copy = NULL;
+    struct curl_slist** last = &copy;
+    struct curl_slist* t;
+    for(t=request->header_tmpl;t;t=t->next){
+        if(hlist_match(t->data,name,name_len)) continue;
+        *last = hlist_node(t->data,strlen(t->data),NULL);
+        last = &(*last)->next;
+    }
+    if(tail) tail->next = copy;
+    else request->header = copy;
+    request->header_tmpl = NULL;
+}
+/** unlink private nodes of that header, template is left alone */
+static void hlist_remove(LwqqHttpRequest* request,const char* name,size_t name_len)
+{
+    struct curl_slist** link = &request->header;
+    struct curl_slist* node;
+    while((node = *link) && node != request->header_tmpl){
+        if(!hlist_match(node->data,name,name_len)){
+            link = &node->next;
+            continue;
+        }
+        *link = node->next;
+        //its line belongs to cookie header
+        if(request->cookie_header && node->data == request->cookie_header->line){
+            lwqq_cookie_header_unref(request->cookie_header);
+            request->cookie_header = NULL;
+        }
+        s_free(node);
+    }
+}
+static void hlist_free(LwqqHttpRequest* request)
+{
+    struct curl_slist* node = request->header;
+    struct curl_slist* next;
+    while(node && node != request->header_tmpl){
+        next = node->next;
+        s_free(node);
+        node = next;
+    }
+    request->header = NULL;
+    request->header_tmpl = NULL;
+}
 static void lwqq_http_set_header(LwqqHttpRequest *request, const char *name,
                                 const char *value)
 {
@@ -69,32 +598,62 @@ static void lwqq_http_set_header(LwqqHttpRequest *request, const char *name,
         return ;
 
     size_t name_len = strlen(name);
-    size_t value_len = strlen(value);
-    char* opt = s_malloc(name_len+value_len+3);
-
-    strcpy(opt,name);
-    opt[name_len] = ':';
-    //need a blank space
-    opt[name_len+1] = ' ';
-    strcpy(opt+name_len+2,value);
+    struct curl_slist* node;
+    //header set again replaces the old one, curl would send both
+    hlist_remove(request,name,name_len);
+    for(node = request->header_tmpl;node;node=node->next){
+        if(hlist_match(node->data,name,name_len)){
+            hlist_fork(request,name,name_len);
+            break;
+        }
+    }
+    node = hlist_node(name,name_len,value);
+    node->next = request->header;
+    request->header = node;
+    curl_easy_setopt(request->req,CURLOPT_HTTPHEADER,request->header);
+}
 
-    request->header = curl_slist_append((struct curl_slist*)request->header,opt);
+static void lwqq_http_set_header_template(LwqqHttpRequest* request,
+        LwqqHttpHeaderClass cls)
+{
+    if(!request->req || cls<0 || cls>=LWQQ_HTTP_HEADER_LENGTH)
+        return;
+    struct curl_slist* tmpl = global.header_tmpl[cls];
+    struct curl_slist* tail = hlist_private_tail(request);
+    if(tail) tail->next = tmpl;
+    else request->header = tmpl;
+    request->header_tmpl = tmpl;
     curl_easy_setopt(request->req,CURLOPT_HTTPHEADER,request->header);
+}
 
-    s_free(opt);
+static void lwqq_http_set_cookie_header(LwqqHttpRequest* request,
+        LwqqCookieHeader* h)
+{
+    struct curl_slist* node;
+    if(!h) return;
+    if(!request->req){
+        lwqq_cookie_header_unref(h);
+        return;
+    }
+    //node is private, its line belongs to h
+    for(node = request->header;node && node != request->header_tmpl;node=node->next){
+        if(request->cookie_header && node->data == request->cookie_header->line)
+            break;
+    }
+    if(node == NULL || node == request->header_tmpl){
+        node = s_malloc(sizeof(*node));
+        node->next = request->header;
+        request->header = node;
+    }
+    node->data = h->line;
+    lwqq_cookie_header_unref(request->cookie_header);
+    request->cookie_header = h;
+    curl_easy_setopt(request->req,CURLOPT_HTTPHEADER,request->header);
 }
 
 static void lwqq_http_set_default_header(LwqqHttpRequest *request)
 {
-    lwqq_http_set_header(request, "User-Agent", LWQQ_HTTP_USER_AGENT);
-    lwqq_http_set_header(request, "Accept", "*/*,text/html, application/xml;q=0.9, "
-                         "application/xhtml+xml, image/png, image/jpeg, "
-                         "image/gif, image/x-xbitmap,;q=0.1");
-    lwqq_http_set_header(request, "Accept-Language", "en-US,zh-CN,zh;q=0.9,en;q=0.8");
-    lwqq_http_set_header(request, "Accept-Charset", "GBK, utf-8, utf-16, *;q=0.1");
-    lwqq_http_set_header(request, "Accept-Encoding", "deflate, gzip, x-gzip, "
-                         "identity, *;q=0");
-    //lwqq_http_set_header(request, "Connection", "Keep-Alive");
+    lwqq_http_set_header_template(request,LWQQ_HTTP_HEADER_DEFAULT);
 }
 
 static const char *lwqq_http_get_header(LwqqHttpRequest *request, const char *name)
@@ -104,24 +663,16 @@ static const char *lwqq_http_get_header(LwqqHttpRequest *request, const char *na
         return NULL; 
     }
 
-    const char *h = NULL;
-    struct curl_slist* list = request->recv_head;
-    while(list!=NULL){
-        if(strncmp(name,list->data,strlen(name))==0){
-            h = list->data+strlen(name)+2;
-            break;
-        }
-        list = list->next;
-    }
-
-    return h;
+    return header_get(request->recv_head,name);
 }
 static void lwqq_http_print_header(LwqqHttpRequest* request)
 {
-    struct curl_slist* list = request->recv_head;
-    while(list!=NULL){
-        puts(list->data);
-        list = list->next;
+    HEADER_TABLE* t = request->recv_head;
+    int i;
+    if(t == NULL) return;
+    for(i=0;i<LWQQ_HTTP_HEADER_SLOTS;i++){
+        if(t->slot[i].name)
+            lwqq_log(LOG_DEBUG,"%s: %s\n",t->slot[i].name,t->slot[i].value);
     }
 }
 
@@ -150,6 +701,104 @@ static char *lwqq_http_get_cookie(LwqqHttpRequest *request, const char *name)
     lwqq_log(LOG_DEBUG, "Parse Cookie: %s=%s\n", name, cookie);
     return s_strdup(cookie);
 }
+static void pool_item_free(CURLPOOL* item)
+{
+    curl_easy_cleanup(item->easy);
+    s_free(item->buf);
+    s_free(item);
+}
+/** drop handles which idle too long. must hold pool_lock */
+static void easy_pool_expire(time_t now)
+{
+    CURLPOOL* item = LIST_FIRST(&global.easy_pool);
+    CURLPOOL* next;
+    while(item){
+        next = LIST_NEXT(item,entries);
+        if(now - item->idle_since > global.pool_expire){
+            LIST_REMOVE(item,entries);
+            global.pool_size--;
+            pool_item_free(item);
+        }
+        item = next;
+    }
+}
+/**
+ * take a easy handle from pool.
+ * it keeps its connection cache, so a request to the same host
+ * would not do tcp handshake again.
+ */
+static CURL* easy_pool_get(char** buf,size_t* buf_cap)
+{
+    CURLPOOL* item;
+    CURL* easy;
+
+    *buf = NULL;
+    *buf_cap = 0;
+    pthread_mutex_lock(&global.pool_lock);
+    easy_pool_expire(time(NULL));
+    item = LIST_FIRST(&global.easy_pool);
+    if(item){
+        LIST_REMOVE(item,entries);
+        global.pool_size--;
+    }
+    pthread_mutex_unlock(&global.pool_lock);
+
+    if(item == NULL)
+        return curl_easy_init();
+    easy = item->easy;
+    *buf = item->buf;
+    *buf_cap = item->buf_cap;
+    s_free(item);
+    return easy;
+}
+static void easy_pool_put(CURL* easy,char* buf,size_t buf_cap)
+{
+    //reset it now. so options not point to freed header or form any more.
+    curl_easy_reset(easy);
+
+    pthread_mutex_lock(&global.pool_lock);
+    easy_pool_expire(time(NULL));
+    if(global.pool_size >= global.pool_max){
+        pthread_mutex_unlock(&global.pool_lock);
+        curl_easy_cleanup(easy);
+        s_free(buf);
+        return;
+    }
+    CURLPOOL* item = s_malloc0(sizeof(*item));
+    item->easy = easy;
+    item->buf = buf;
+    item->buf_cap = buf_cap;
+    item->idle_since = time(NULL);
+    LIST_INSERT_HEAD(&global.easy_pool,item,entries);
+    global.pool_size++;
+    pthread_mutex_unlock(&global.pool_lock);
+}
+static void easy_pool_clean()
+{
+    CURLPOOL* item;
+    pthread_mutex_lock(&global.pool_lock);
+    while((item = LIST_FIRST(&global.easy_pool))){
+        LIST_REMOVE(item,entries);
+        pool_item_free(item);
+    }
+    global.pool_size = 0;
+    pthread_mutex_unlock(&global.pool_lock);
+}
+void lwqq_http_pool_config(int max_size,int idle_expire)
+{
+    pthread_mutex_lock(&global.pool_lock);
+    if(max_size >= 0) global.pool_max = max_size;
+    if(idle_expire >= 0) global.pool_expire = idle_expire;
+    //shrink pool to new size
+    CURLPOOL* item;
+    while(global.pool_size > global.pool_max){
+        item = LIST_FIRST(&global.easy_pool);
+        LIST_REMOVE(item,entries);
+        global.pool_size--;
+        pool_item_free(item);
+    }
+    pthread_mutex_unlock(&global.pool_lock);
+}
 /** 
  * Free Http Request
  * 
@@ -161,37 +810,207 @@ void lwqq_http_request_free(LwqqHttpRequest *request)
         return ;
     
     if (request) {
-        s_free(request->response);
-        curl_slist_free_all(request->header);
-        curl_slist_free_all(request->recv_head);
-        slist_free_all(request->cookie);
-        curl_formfree(request->form_start);
+        //keep spare one or a small response buffer for next request
+        resp_reset(request);
+        //give back handle first. it still reference header and form.
         if(request->req)
-            curl_easy_cleanup(request->req);
-        //LIST_INSERT_HEAD(&global.easy_pool,(CURLPOOL*)request->req,entries);
+            easy_pool_put(request->req,request->resp_spare,request->spare_cap);
+        else
+            s_free(request->resp_spare);
+        hlist_free(request);
+        lwqq_cookie_header_unref(request->cookie_header);
+        header_free(request->recv_head);
+        s_free(request->host);
+        s_free(request->flight_key);
+        curl_formfree(request->form_start);
+#if LWQQ_HTTP_MIME
+        curl_mime_free(request->mime);
+#endif
+        stream_free_all(request);
         s_free(request);
     }
 }
 
 static size_t write_header( void *ptr, size_t size, size_t nmemb, void *userdata)
 {
-    char* str = (char*)ptr;
+    const char* str = (char*)ptr;
     LwqqHttpRequest* request = (LwqqHttpRequest*) userdata;
+    HEADER_TABLE* t;
+    size_t len = size*nmemb;
+    const char *colon,*value,*end;
 
     long http_code;
     curl_easy_getinfo(request->req,CURLINFO_RESPONSE_CODE,&http_code);
     //this is a redirection. ignore it.
     if(http_code == 301||http_code == 302)
         return size*nmemb;
-    request->recv_head = curl_slist_append(request->recv_head,(char*)ptr);
+    if(request->recv_head == NULL)
+        request->recv_head = s_malloc0(sizeof(HEADER_TABLE));
+    t = request->recv_head;
+
+    //header line is not terminated by '\0'
+    while(len>0 && (str[len-1]=='\r'||str[len-1]=='\n')) len--;
+    if(len == 0)
+        return size*nmemb;
+    //status line begin a new response (e.g. after 100 Continue)
+    if(len>5 && strncmp(str,"HTTP/",5)==0){
+        header_clear(t);
+        return size*nmemb;
+    }
+    colon = memchr(str,':',len);
+    if(colon == NULL)
+        return size*nmemb;
+    end = str+len;
+    value = trim(colon+1,&end);
+    header_put(t,str,colon-str,value,end-value);
     //read cookie from header;
-    if(strncmp(str,"Set-Cookie",strlen("Set-Cookie"))==0){
-        struct cookie_list * node = s_malloc0(sizeof(*node));
-        sscanf(str,"Set-Cookie: %[^=]=%[^;];",node->name,node->value);
-        request->cookie = slist_append(request->cookie,node);
+    if(colon-str == 10 && strncasecmp(str,"Set-Cookie",10)==0){
+        struct cookie_list * node = parse_cookie(t,value,end-value);
+        if(node)
+            request->cookie = slist_append(request->cookie,node);
     }
     return size*nmemb;
 }
+/**
+ * make sure response buffer can hold extra bytes and a '\0'.
+ * it grows double, and never larger than resp_max.
+ * a recycled buffer is used first when there is one.
+ */
+static int resp_reserve(LwqqHttpRequest* request,size_t extra)
+{
+    size_t max = request->resp_max?request->resp_max:LWQQ_HTTP_RESP_MAX;
+    size_t need,cap;
+
+    if(request->response == NULL){
+        request->resp_len = 0;
+        request->resp_cap = 0;
+        if(request->resp_spare){
+            request->response = request->resp_spare;
+            request->resp_cap = request->spare_cap;
+            request->resp_spare = NULL;
+            request->spare_cap = 0;
+        }
+    }
+    if(extra > max || request->resp_len > max - extra)
+        return -1;
+    need = request->resp_len + extra + 1;
+    if(need <= request->resp_cap)
+        return 0;
+    cap = request->resp_cap?request->resp_cap:LWQQ_HTTP_RESP_INIT;
+    while(cap < need) cap *= 2;
+    if(cap > max + 1) cap = max + 1;
+    request->response = s_realloc(request->response,cap);
+    request->resp_cap = cap;
+    return 0;
+}
+static int resp_append(LwqqHttpRequest* request,const void* data,size_t len)
+{
+    if(resp_reserve(request,len))
+        return -1;
+    memcpy(request->response+request->resp_len,data,len);
+    request->resp_len += len;
+    request->response[request->resp_len] = '\0';
+    return 0;
+}
+static void resp_drop(LwqqHttpRequest* request)
+{
+    s_free(request->response);
+    request->response = NULL;
+    request->resp_len = 0;
+    request->resp_cap = 0;
+}
+/**
+ * clear off last response.
+ * a small response buffer is kept as spare for next one.
+ */
+static void resp_reset(LwqqHttpRequest* request)
+{
+    inflate_end(request);
+    if(request->response && request->resp_spare == NULL &&
+            request->resp_cap <= LWQQ_HTTP_RESP_KEEP){
+        request->resp_spare = request->response;
+        request->spare_cap = request->resp_cap;
+        request->response = NULL;
+    }
+    resp_drop(request);
+    request->http_code = 0;
+    //cookie nodes live in header arena
+    if(request->recv_head)
+        header_reset(request->recv_head);
+    request->cookie = NULL;
+}
+/**
+ * start inflate if server send compressed content.
+ * 47 enable zlib and gzip decoding with automatic header detection
+ */
+static int inflate_begin(LwqqHttpRequest* request)
+{
+    const char* enc_type = request->get_header(request,"Content-Encoding");
+    if(enc_type == NULL || !(strstr(enc_type,"gzip")||strstr(enc_type,"deflate")))
+        return 0;
+    z_stream* strm = s_malloc0(sizeof(*strm));
+    if(inflateInit2(strm,47) != Z_OK){
+        lwqq_log(LOG_ERROR, "Init zlib error\n");
+        s_free(strm);
+        return -1;
+    }
+    request->inflate = strm;
+    return 0;
+}
+static void inflate_end(LwqqHttpRequest* request)
+{
+    if(request->inflate == NULL) return;
+    inflateEnd(request->inflate);
+    s_free(request->inflate);
+    request->inflate = NULL;
+}
+/**
+ * inflate one received chunk directly into response buffer.
+ * response is always terminated with '\0', but resp_len not count it,
+ * so binary data is safe.
+ */
+static int inflate_append(LwqqHttpRequest* request,void* data,size_t len)
+{
+    z_stream* strm = request->inflate;
+    size_t max = request->resp_max?request->resp_max:LWQQ_HTTP_RESP_MAX;
+    size_t room,chunk;
+    Bytef probe;
+    int ret;
+
+    strm->next_in = (Bytef*)data;
+    strm->avail_in = len;
+    do{
+        //last chunk only asks what is left under the limit
+        room = max - request->resp_len;
+        chunk = room < LWQQ_INFLATE_CHUNK ? room : LWQQ_INFLATE_CHUNK;
+        if(chunk){
+            if(resp_reserve(request,chunk)) return -1;
+            strm->next_out = (Bytef*)request->response+request->resp_len;
+        }else
+            //buffer is full, over limit only if stream still has output
+            strm->next_out = &probe;
+        strm->avail_out = chunk?chunk:1;
+        ret = inflate(strm,Z_NO_FLUSH);
+        switch(ret){
+            case Z_NEED_DICT:
+            case Z_DATA_ERROR:
+            case Z_MEM_ERROR:
+            case Z_STREAM_ERROR:
+                lwqq_log(LOG_ERROR, "Ungzip stream error:%s\n", strm->msg);
+                return -1;
+        }
+        if(chunk == 0){
+            if(strm->avail_out == 0){
+                lwqq_log(LOG_ERROR, "Inflated response over limit\n");
+                return -1;
+            }
+            break;
+        }
+        request->resp_len += chunk - strm->avail_out;
+        request->response[request->resp_len] = '\0';
+    }while(strm->avail_out == 0 && ret != Z_STREAM_END);
+    return 0;
+}
 static size_t write_content(void* ptr,size_t size,size_t nmemb,void* userdata)
 {
     LwqqHttpRequest* request = (LwqqHttpRequest*) userdata;
@@ -200,25 +1019,38 @@ static size_t write_content(void* ptr,size_t size,size_t nmemb,void* userdata)
     //this is a redirection. ignore it.
     if(http_code == 301||http_code == 302)
         return size*nmemb;
-    int resp_len = request->resp_len;
-    if(request->response==NULL){
-        const char* content_length = request->get_header(request,"Content-Length");
-        if(content_length){
-            size_t length = atol(content_length);
-            request->response = s_malloc0(length+10);
-            request->resp_realloc = 0;
-        }else{
-            request->response = s_malloc0(size*nmemb+10);
-            request->resp_realloc = 1;
+    if(request->response==NULL && request->inflate==NULL){
+        if(inflate_begin(request)) return 0;
+        //content length is known to curl after header parsed.
+        //only a hint, never allocate more than the limit.
+        if(request->inflate == NULL){
+#if LIBCURL_VERSION_NUM >= 0x073700
+            curl_off_t length = -1;
+            curl_easy_getinfo(request->req,CURLINFO_CONTENT_LENGTH_DOWNLOAD_T,&length);
+#else
+            double length = -1;
+            curl_easy_getinfo(request->req,CURLINFO_CONTENT_LENGTH_DOWNLOAD,&length);
+#endif
+            if(length > 0 && resp_reserve(request,length)){
+                lwqq_log(LOG_WARNING,"Content-Length %ld over limit\n",(long)length);
+                return 0;
+            }
         }
-        resp_len = 0;
-        request->resp_len = 0;
     }
-    if(request->resp_realloc){
-        request->response = s_realloc(request->response,resp_len+size*nmemb+5);
+    if(request->inflate){
+        if(inflate_append(request,ptr,size*nmemb)){
+            //abort transfer and drop broken content
+            inflate_end(request);
+            resp_drop(request);
+            return 0;
+        }
+        return size*nmemb;
+    }
+    if(resp_append(request,ptr,size*nmemb)){
+        lwqq_log(LOG_WARNING,"Response over limit, drop it\n");
+        resp_drop(request);
+        return 0;
     }
-    memcpy(request->response+resp_len,ptr,size*nmemb);
-    request->resp_len+=size*nmemb;
     return size*nmemb;
 }
 /** 
@@ -237,16 +1069,31 @@ LwqqHttpRequest *lwqq_http_request_new(const char *uri)
     LwqqHttpRequest *request;
     request = s_malloc0(sizeof(*request));
     
-    request->req = curl_easy_init();
+    request->req = easy_pool_get(&request->resp_spare,&request->spare_cap);
     if (!request->req) {
         /* Seem like request->req must be non null. FIXME */
         goto failed;
     }
-    if(curl_easy_setopt(request->req,CURLOPT_URL,uri)!=0){
+    //host part of url, used by scheduler
+    const char* host = strstr(uri,"://");
+    host = host?host+3:uri;
+    if(global.base_url){
+        //http://d.web2.qq.com/channel/poll2 -> <base_url>/d.web2.qq.com/channel/poll2
+        char* rebased = s_malloc(strlen(global.base_url)+strlen(host)+2);
+        sprintf(rebased,"%s/%s",global.base_url,host);
+        int rc = curl_easy_setopt(request->req,CURLOPT_URL,rebased);
+        s_free(rebased);
+        if(rc != 0){
+            lwqq_log(LOG_WARNING, "Invalid uri: %s\n", uri);
+            goto failed;
+        }
+    }else if(curl_easy_setopt(request->req,CURLOPT_URL,uri)!=0){
         lwqq_log(LOG_WARNING, "Invalid uri: %s\n", uri);
         goto failed;
     }
-    if(global.share==NULL) lwqq_http_global_init();
+    request->host = s_strndup(host,strcspn(host,"/?#"));
+    request->priority = LWQQ_HTTP_PRIO_ROSTER;
+    if(global.share==NULL) global_setup();
     curl_easy_setopt(request->req,CURLOPT_SHARE,global.share);
     curl_easy_setopt(request->req,CURLOPT_HEADERFUNCTION,write_header);
     curl_easy_setopt(request->req,CURLOPT_HEADERDATA,request);
@@ -254,10 +1101,19 @@ LwqqHttpRequest *lwqq_http_request_new(const char *uri)
     curl_easy_setopt(request->req,CURLOPT_WRITEDATA,request);
     curl_easy_setopt(request->req,CURLOPT_NOSIGNAL,1);
     curl_easy_setopt(request->req,CURLOPT_FOLLOWLOCATION,1);
+#if LIBCURL_VERSION_NUM >= 0x071900
+    //keep idle pooled connection alive
+    curl_easy_setopt(request->req,CURLOPT_TCP_KEEPALIVE,1L);
+#endif
     request->do_request = lwqq_http_do_request;
     request->do_request_async = lwqq_http_do_request_async;
     request->set_header = lwqq_http_set_header;
     request->set_default_header = lwqq_http_set_default_header;
+    request->set_header_template = lwqq_http_set_header_template;
+    request->set_cookie_header = lwqq_http_set_cookie_header;
+    request->add_file_fd = lwqq_http_add_file_fd;
+    request->set_progress = lwqq_http_set_progress;
+    request->set_single_flight = lwqq_http_set_single_flight;
     request->get_header = lwqq_http_get_header;
     request->get_cookie = lwqq_http_get_cookie;
     request->add_form = lwqq_http_add_form;
@@ -271,93 +1127,6 @@ failed:
     return NULL;
 }
 
-static char *unzlib(const char *source, int len, int *total, int isgzip)
-{
-#define CHUNK 16 * 1024
-    int ret;
-    unsigned have;
-    z_stream strm;
-    unsigned char out[CHUNK];
-    int totalsize = 0;
-    char *dest = NULL;
-
-    if (!source || len <= 0 || !total)
-        return NULL;
-
-/* allocate inflate state */
-    strm.zalloc = Z_NULL;
-    strm.zfree = Z_NULL;
-    strm.opaque = Z_NULL;
-    strm.avail_in = 0;
-    strm.next_in = Z_NULL;
-
-    if(isgzip) {
-        /**
-         * 47 enable zlib and gzip decoding with automatic header detection,
-         * So if the format of compress data is gzip, we need passed it to
-         * inflateInit2
-         */
-        ret = inflateInit2(&strm, 47);
-    } else {
-        ret = inflateInit(&strm);
-    }
-
-    if (ret != Z_OK) {
-        lwqq_log(LOG_ERROR, "Init zlib error\n");
-        return NULL;
-    }
-
-    strm.avail_in = len;
-    strm.next_in = (Bytef *)source;
-
-    do {
-        strm.avail_out = CHUNK;
-        strm.next_out = out;
-        ret = inflate(&strm, Z_NO_FLUSH);
-        switch (ret) {
-        case Z_STREAM_END:
-            break;
-        case Z_BUF_ERROR:
-            lwqq_log(LOG_ERROR, "Unzlib error\n");
-            break;
-        case Z_NEED_DICT:
-            ret = Z_DATA_ERROR; /* and fall through */
-            break;
-        case Z_DATA_ERROR:
-        case Z_MEM_ERROR:
-        case Z_STREAM_ERROR:
-            lwqq_log(LOG_ERROR, "Ungzip stream error!", strm.msg);
-            inflateEnd(&strm);
-            goto failed;
-        }
-        have = CHUNK - strm.avail_out;
-        totalsize += have;
-        dest = s_realloc(dest, totalsize);
-        memcpy(dest + totalsize - have, out, have);
-    } while (strm.avail_out == 0);
-
-/* clean up and return */
-    (void)inflateEnd(&strm);
-    if (ret != Z_STREAM_END) {
-        goto failed;
-    }
-    *total = totalsize;
-    return dest;
-
-failed:
-    if (dest) {
-        s_free(dest);
-    }
-    lwqq_log(LOG_ERROR, "Unzip error\n");
-    return NULL;
-}
-
-static char *ungzip(const char *source, int len, int *total)
-{
-    return unzlib(source, len, total, 1);
-}
-
-
 /** 
  * Create a default http request object using default http header.
  * 
@@ -390,79 +1159,434 @@ LwqqHttpRequest *lwqq_http_create_default_request(const char *url,
     //lwqq_log(LOG_DEBUG, "Create request object for url: %s sucessfully\n", url);
     return req;
 }
+LwqqHttpRequest *lwqq_http_create_client_request(LwqqClient* lc,const char *url,
+                                                 LwqqErrorCode *err)
+{
+    LwqqHttpRequest *req = lwqq_http_create_default_request(url,err);
+    if(req)
+        req->owner = lc;
+    return req;
+}
 
 /************************************************************************/
 /* Those Code for async API */
 
 
+static double now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec*1000.0+ts.tv_nsec/1000000.0;
+}
+static void hist_add(unsigned* hist,double ms)
+{
+    int b = 0;
+    while(ms >= 1.0 && b < LWQQ_HTTP_HIST_BUCKETS-1){
+        ms /= 2;
+        b++;
+    }
+    hist[b]++;
+}
+/** upper bound of bucket where p of values fall in */
+static long hist_percentile(const unsigned* hist,double p)
+{
+    unsigned long total = 0,sum = 0;
+    int b;
+    for(b=0;b<LWQQ_HTTP_HIST_BUCKETS;b++) total += hist[b];
+    if(total == 0) return -1;
+    for(b=0;b<LWQQ_HTTP_HIST_BUCKETS;b++){
+        sum += hist[b];
+        if(sum >= total*p) break;
+    }
+    return 1L<<b;
+}
+/** last path segment of url, e.g. http://d.web2.qq.com/channel/poll2 is poll2 */
+static void endpoint_name(const char* url,char* buf,size_t size)
+{
+    const char* p = strstr(url,"://");
+    const char *seg,*end;
+    p = p?p+3:url;
+    end = p + strcspn(p,"?#");
+    while(end>p && end[-1]=='/') end--;
+    seg = end;
+    while(seg>p && seg[-1]!='/') seg--;
+    snprintf(buf,size,"%.*s",(int)(end-seg),seg);
+}
+static ENDPOINT_STAT* endpoint_get(GLOBAL* g,const char* name)
+{
+    ENDPOINT_STAT* st;
+    LIST_FOREACH(st,&g->endpoints,entries){
+        if(strcmp(st->name,name)==0) return st;
+    }
+    if(g->endpoint_count >= LWQQ_HTTP_MAX_ENDPOINTS && strcmp(name,"other")!=0)
+        return endpoint_get(g,"other");
+    st = s_malloc0(sizeof(*st));
+    strncpy(st->name,name,sizeof(st->name)-1);
+    st->window_start = time(NULL);
+    LIST_INSERT_HEAD(&g->endpoints,st,entries);
+    g->endpoint_count++;
+    return st;
+}
+/**
+ * record timing of a finished request, from curl info.
+ * @param queue_ms time waited in scheduler, <0 for sync request
+ */
+static void timing_record(GLOBAL* g,LwqqHttpRequest* request,double queue_ms)
+{
+    CURL* easy = request->req;
+    char* url = NULL;
+    char name[48];
+    double dns = 0,conn = 0,tls = 0,first = 0,total = 0,up = 0,down = 0;
+    double t[T_LENGTH];
+    int i;
+
+    curl_easy_getinfo(easy,CURLINFO_EFFECTIVE_URL,&url);
+    curl_easy_getinfo(easy,CURLINFO_NAMELOOKUP_TIME,&dns);
+    curl_easy_getinfo(easy,CURLINFO_CONNECT_TIME,&conn);
+    curl_easy_getinfo(easy,CURLINFO_APPCONNECT_TIME,&tls);
+    curl_easy_getinfo(easy,CURLINFO_STARTTRANSFER_TIME,&first);
+    curl_easy_getinfo(easy,CURLINFO_TOTAL_TIME,&total);
+#if LIBCURL_VERSION_NUM >= 0x073700
+    curl_off_t up_t = 0,down_t = 0;
+    curl_easy_getinfo(easy,CURLINFO_SIZE_UPLOAD_T,&up_t);
+    curl_easy_getinfo(easy,CURLINFO_SIZE_DOWNLOAD_T,&down_t);
+    up = (double)up_t;
+    down = (double)down_t;
+#else
+    curl_easy_getinfo(easy,CURLINFO_SIZE_UPLOAD,&up);
+    curl_easy_getinfo(easy,CURLINFO_SIZE_DOWNLOAD,&down);
+#endif
+    endpoint_name(url?url:"",name,sizeof(name));
+
+    //curl times are counted from start, make them phases.
+    t[T_QUEUE] = queue_ms;
+    t[T_DNS] = dns*1000;
+    t[T_CONNECT] = conn>dns?(conn-dns)*1000:0;
+    t[T_TLS] = tls>conn?(tls-conn)*1000:-1;
+    if(tls > conn) conn = tls;
+    t[T_FIRST_BYTE] = first>conn?(first-conn)*1000:0;
+    t[T_TOTAL] = total*1000;
+
+    pthread_mutex_lock(&g->stat_lock);
+    ENDPOINT_STAT* st = endpoint_get(g,name);
+    time_t now = time(NULL);
+    if(now - st->window_start >= LWQQ_HTTP_HIST_WINDOW){
+        memcpy(st->hist[1],st->hist[0],sizeof(st->hist[0]));
+        memset(st->hist[0],0,sizeof(st->hist[0]));
+        st->window_start = now;
+    }
+    for(i=0;i<T_LENGTH;i++){
+        if(t[i] >= 0) hist_add(st->hist[0][i],t[i]);
+    }
+    st->count++;
+    if(request->http_code < 200 || request->http_code >= 400) st->failed++;
+    st->bytes_up += up;
+    st->bytes_down += down;
+    pthread_mutex_unlock(&g->stat_lock);
+}
+void lwqq_http_timing_dump(FILE* f)
+{
+    ENDPOINT_STAT* st;
+    unsigned hist[LWQQ_HTTP_HIST_BUCKETS];
+    int i,b;
+
+    pthread_mutex_lock(&global.stat_lock);
+    fprintf(f,"http timing of last %d-%d seconds (ms, bucket upper bound)\n",
+            LWQQ_HTTP_HIST_WINDOW,LWQQ_HTTP_HIST_WINDOW*2);
+    LIST_FOREACH(st,&global.endpoints,entries){
+        fprintf(f,"\n%s: %lu requests, %lu failed, sent %.1fKB, received %.1fKB\n",
+                st->name,st->count,st->failed,st->bytes_up/1024,st->bytes_down/1024);
+        fprintf(f,"  %-12s %8s %8s %8s\n","phase","p50","p90","p99");
+        for(i=0;i<T_LENGTH;i++){
+            for(b=0;b<LWQQ_HTTP_HIST_BUCKETS;b++)
+                hist[b] = st->hist[0][i][b]+st->hist[1][i][b];
+            if(hist_percentile(hist,1.0) < 0) continue;
+            fprintf(f,"  %-12s %8ld %8ld %8ld\n",timing_names[i],
+                    hist_percentile(hist,0.5),hist_percentile(hist,0.9),
+                    hist_percentile(hist,0.99));
+        }
+    }
+    pthread_mutex_unlock(&global.stat_lock);
+}
+/** save response body as <record_dir>/<endpoint>, replayed by mock server */
+static void record_response(GLOBAL* g,LwqqHttpRequest* request)
+{
+    char* url = NULL;
+    char name[48];
+    char path[512];
+    FILE* f;
+    if(g->record_dir == NULL || request->response == NULL) return;
+
+    curl_easy_getinfo(request->req,CURLINFO_EFFECTIVE_URL,&url);
+    endpoint_name(url,name,sizeof(name));
+    snprintf(path,sizeof(path),"%s/%s",g->record_dir,name);
+    f = fopen(path,"wb");
+    if(f == NULL){
+        lwqq_log(LOG_WARNING,"record %s failed\n",path);
+        return;
+    }
+    fwrite(request->response,1,request->resp_len,f);
+    fclose(f);
+}
+static OWNER_ITEM* owner_get(GLOBAL* g,void* owner)
+{
+    OWNER_ITEM* item;
+    LIST_FOREACH(item,&g->owners,entries){
+        if(item->owner == owner) return item;
+    }
+    item = s_malloc0(sizeof(*item));
+    item->owner = owner;
+    LIST_INSERT_HEAD(&g->owners,item,entries);
+    return item;
+}
+static void item_free(D_ITEM* di)
+{
+    pthread_mutex_lock(&global.item_lock);
+    LIST_REMOVE(di,item_entries);
+    pthread_mutex_unlock(&global.item_lock);
+    s_free(di);
+}
+/** give follower a copy of response, so its callback can own it */
+static void flight_copy(LwqqHttpRequest* to,LwqqHttpRequest* from)
+{
+    HEADER_TABLE* t = from->recv_head;
+    int i;
+    to->http_code = from->http_code;
+    if(from->response)
+        resp_append(to,from->response,from->resp_len);
+    if(t == NULL) return;
+    if(to->recv_head == NULL)
+        to->recv_head = s_malloc0(sizeof(HEADER_TABLE));
+    for(i=0;i<LWQQ_HTTP_HEADER_SLOTS;i++){
+        HEADER_SLOT* slot = &t->slot[i];
+        if(slot->name)
+            header_put(to->recv_head,slot->name,strlen(slot->name),
+                    slot->value,strlen(slot->value));
+    }
+}
+/** leave flight table and answer every follower with our response */
+static void flight_land(D_ITEM* conn)
+{
+    D_ITEM* f;
+    int res;
+    if(!conn->in_flight) return;
+    pthread_mutex_lock(&global.flight_lock);
+    LIST_REMOVE(conn,flight_entries);
+    conn->in_flight = 0;
+    pthread_mutex_unlock(&global.flight_lock);
+    while((f = TAILQ_FIRST(&conn->followers))){
+        TAILQ_REMOVE(&conn->followers,f,entries);
+        f->result = conn->result;
+        owner_get(&global,f->req->owner)->stats.coalesced++;
+        flight_copy(f->req,conn->req);
+        res = f->callback(f->req,f->data);
+        lwqq_async_event_set_result(f->event,res);
+        lwqq_async_event_finish(f->event);
+        item_free(f);
+    }
+}
 static void async_complete(D_ITEM* conn)
 {
     LwqqHttpRequest* request = conn->req;
-    int have_read_bytes;
     int res;
-    char** resp = &request->response;
 
-    have_read_bytes = request->resp_len;
     curl_easy_getinfo(request->req,CURLINFO_RESPONSE_CODE,&request->http_code);
+    /* content already inflated in write_content */
+    inflate_end(request);
+    timing_record(&global,request,conn->queue_ms);
+    record_response(&global,request);
+    //before our callback, it may free request
+    flight_land(conn);
 
-    /* NB: *response may null */
-    if (*resp == NULL) {
-        goto failed;
-    }
-
-    /* Uncompress data here if we have a Content-Encoding header */
-    const char *enc_type = NULL;
-    enc_type = lwqq_http_get_header(request, "Content-Encoding");
-    if (enc_type && strstr(enc_type, "gzip")) {
-        char *outdata;
-        int total = 0;
-        
-        outdata = ungzip(*resp, have_read_bytes, &total);
-        if (!outdata) {
-            goto failed;
-        }
-
-        s_free(*resp);
-        /* Update response data to uncompress data */
-        *resp = s_strdup(outdata);
-        (*resp)[total] = '\0';
-        s_free(outdata);
-        have_read_bytes = total;
-        request->resp_len = total;
-    }
-failed:
     res = conn->callback(request,conn->data);
     lwqq_async_event_set_result(conn->event,res);
     lwqq_async_event_finish(conn->event);
     return ;
 }
 
+static HOST_ITEM* host_get(GLOBAL* g,const char* host)
+{
+    HOST_ITEM* item;
+    LIST_FOREACH(item,&g->hosts,entries){
+        if(strcmp(item->host,host)==0) return item;
+    }
+    item = s_malloc0(sizeof(*item));
+    item->host = s_strdup(host);
+    LIST_INSERT_HEAD(&g->hosts,item,entries);
+    return item;
+}
+/**
+ * move waiting requests into multi, higher priority first.
+ * send and poll are never held, other classes are limited
+ * by total running, running per host and running per owner.
+ */
+static void schedule_run(GLOBAL* g)
+{
+    int prio;
+    D_ITEM *di,*next;
+    CURLMcode rc;
+    for(prio=0;prio<LWQQ_HTTP_PRIO_LENGTH;prio++){
+        int limited = (prio >= LWQQ_HTTP_PRIO_ROSTER);
+        for(di=TAILQ_FIRST(&g->waiting[prio]);di;di=next){
+            next = TAILQ_NEXT(di,entries);
+            if(limited && g->running >= g->max_running) return;
+            HOST_ITEM* host = host_get(g,di->req->host?di->req->host:"");
+            if(limited && host->running >= g->max_per_host) continue;
+            OWNER_ITEM* account = di->account;
+            if(limited && account->max_running &&
+                    account->stats.running >= account->max_running) continue;
+
+            TAILQ_REMOVE(&g->waiting[prio],di,entries);
+            g->stats.waiting[prio]--;
+            account->stats.waiting[prio]--;
+            //waiter gives up at deadline, so does the transfer
+            long left = lwqq_async_event_time_left(di->event);
+            if(left >= 0)
+                curl_easy_setopt(di->req->req,CURLOPT_TIMEOUT_MS,left>0?left:1L);
+            rc = curl_multi_add_handle(g->multi,di->req->req);
+            if(rc != CURLM_OK){
+                lwqq_log(LOG_ERROR,"add handle failed:%s\n",curl_multi_strerror(rc));
+                di->result = CURLE_FAILED_INIT;
+                async_complete(di);
+                item_free(di);
+                continue;
+            }
+            di->state = DI_RUNNING;
+            di->host = host;
+            di->queue_ms = now_ms() - di->queue_ms;
+            host->running++;
+            account->stats.running++;
+            g->running++;
+            g->stats.running = g->running;
+        }
+    }
+}
+static void schedule_done(GLOBAL* g,D_ITEM* di)
+{
+    if(di->host){
+        di->host->running--;
+        di->host = NULL;
+        di->account->stats.running--;
+        g->running--;
+        g->stats.running = g->running;
+    }
+}
+static int retry_transient(D_ITEM* di)
+{
+    long code = 0;
+    switch(di->result){
+        case CURLE_OK:
+            curl_easy_getinfo(di->req->req,CURLINFO_RESPONSE_CODE,&code);
+            return code >= 500 || code == 408 || code == 429;
+        case CURLE_COULDNT_RESOLVE_HOST:
+        case CURLE_COULDNT_CONNECT:
+        case CURLE_OPERATION_TIMEDOUT:
+        case CURLE_SEND_ERROR:
+        case CURLE_RECV_ERROR:
+        case CURLE_GOT_NOTHING:
+        case CURLE_PARTIAL_FILE:
+            return 1;
+        default:
+            return 0;
+    }
+}
+static int retry_come(void* data)
+{
+    D_ITEM* di = data;
+    di->retry_timer = 0;
+    resp_reset(di->req);
+    di->host = NULL;
+    di->queue_ms = now_ms();
+    submit_handle(&global,di);
+    return 0;
+}
+/**
+ * retry a failed request after capped exponential backoff with jitter.
+ * @return 1 if it would be retried, caller should not complete it.
+ */
+static int retry_schedule(GLOBAL* g,D_ITEM* di)
+{
+    int prio = di->req->priority;
+    if(prio < 0 || prio >= LWQQ_HTTP_PRIO_LENGTH) prio = LWQQ_HTTP_PRIO_ROSTER;
+    RETRY_POLICY* p = &g->retry[prio];
+
+    if(di->attempt == 0){
+        g->retry_tokens += LWQQ_HTTP_RETRY_RATIO;
+        if(g->retry_tokens > LWQQ_HTTP_RETRY_BUDGET)
+            g->retry_tokens = LWQQ_HTTP_RETRY_BUDGET;
+    }
+    //a POST may have taken effect on server already
+    if(di->method != 0 && !di->req->idempotent)
+        return 0;
+    if(di->attempt >= p->max_retry || !retry_transient(di))
+        return 0;
+    //waiter gives up now, a retry would be wasted
+    if(lwqq_async_event_time_left(di->event) == 0)
+        return 0;
+    if(g->retry_tokens < 1.0){
+        lwqq_log(LOG_WARNING,"retry budget exhausted, give up\n");
+        return 0;
+    }
+    g->retry_tokens -= 1.0;
+
+    long delay = p->base_ms;
+    int i;
+    for(i=0;i<di->attempt && delay<p->max_ms;i++) delay *= 2;
+    if(delay > p->max_ms) delay = p->max_ms;
+    //equal jitter: half fixed, half random
+    delay = delay/2 + g_random_int_range(0,delay/2+1);
+    di->attempt++;
+
+    curl_easy_getinfo(di->req->req,CURLINFO_RESPONSE_CODE,&di->req->http_code);
+    timing_record(g,di->req,di->queue_ms);
+    lwqq_log(LOG_NOTICE,"retry %d of request after %ldms:%s\n",di->attempt,delay,
+            curl_easy_strerror(di->result));
+    di->state = DI_RETRY;
+    di->retry_timer = purple_timeout_add(delay,retry_come,di);
+    return 1;
+}
+void lwqq_http_set_retry_policy(LwqqHttpPriority prio,int max_retry,int base_ms,int max_ms)
+{
+    if(prio < 0 || prio >= LWQQ_HTTP_PRIO_LENGTH) return;
+    RETRY_POLICY* p = &global.retry[prio];
+    p->max_retry = max_retry;
+    if(base_ms > 0) p->base_ms = base_ms;
+    if(max_ms > 0) p->max_ms = max_ms;
+}
 static void check_multi_info(GLOBAL *g)
 {
     CURLMsg *msg=NULL;
     int msgs_left;
     D_ITEM *conn;
     CURL *easy;
-
+    int done = 0;
 
     while ((msg = curl_multi_info_read(g->multi, &msgs_left))) {
         if (msg->msg == CURLMSG_DONE) {
             easy = msg->easy_handle;
             curl_easy_getinfo(easy, CURLINFO_PRIVATE, &conn);
+            conn->result = msg->data.result;
 
             curl_multi_remove_handle(g->multi, easy);
+            schedule_done(g,conn);
+            done++;
+            if(retry_schedule(g,conn))
+                continue;
 
             //执行完成时候的回调
             async_complete(conn);
-            s_free(conn);
+            item_free(conn);
         }
     }
+    //slots are free, let waiting ones go
+    if(done) schedule_run(g);
 }
 static int timer_cb(void* data)
 {
     //这个表示有超时任务出现.
     GLOBAL* g = data;
 
+    g->timer_event = 0;
     if(!g->multi) return 0;
     curl_multi_socket_action(g->multi, CURL_SOCKET_TIMEOUT, 0, &g->still_running);
     check_multi_info(g);
@@ -471,12 +1595,13 @@ static int timer_cb(void* data)
 static int multi_timer_cb(CURLM *multi, long timeout_ms, void *userp)
 {
     GLOBAL* g = userp;
-    purple_timeout_remove(g->timer_event);
-    if (timeout_ms > 0) {
+    if(g->timer_event)
+        purple_timeout_remove(g->timer_event);
+    g->timer_event = 0;
+    //timeout 0 means kick it as soon as possible.
+    //never call socket_action in here, it is called inside curl.
+    if (timeout_ms >= 0)
         g->timer_event = purple_timeout_add(timeout_ms,timer_cb,g);
-    } else if(timeout_ms==0)
-        timer_cb(g);
-    else{}
     return 0;
 }
 static void event_cb(void* data,int fd,PurpleInputCondition revents)
@@ -488,8 +1613,9 @@ static void event_cb(void* data,int fd,PurpleInputCondition revents)
     if(!g->multi) return;
     curl_multi_socket_action(g->multi, fd, action, &g->still_running);
     check_multi_info(g);
-    if ( g->still_running <= 0 ) {
+    if ( g->still_running <= 0 && g->timer_event ) {
         purple_timeout_remove(g->timer_event);
+        g->timer_event = 0;
     }
 }
 static void setsock(S_ITEM*f, curl_socket_t s, CURL*e, int act,GLOBAL* g)
@@ -529,34 +1655,69 @@ static int sock_cb(CURL* e,curl_socket_t s,int what,void* cbp,void* sockp)
     }
     return 0;
 }
-static int delay_add_handle(void* data)
+/**
+ * queue all handles submitted in this loop iteration by priority,
+ * schedule them into multi, then kick them with one socket_action.
+ */
+static int submit_flush(void* data)
 {
-    D_ITEM* di = data;
-    CURLMcode rc = curl_multi_add_handle(global.multi,di->req->req);
-
-    if(rc != CURLM_OK){
-        puts(curl_multi_strerror(rc));
+    GLOBAL* g = data;
+    D_ITEM* di;
+    int prio;
+    TAILQ_HEAD(,D_ITEM) batch = TAILQ_HEAD_INITIALIZER(batch);
+
+    pthread_mutex_lock(&g->submit_lock);
+    TAILQ_CONCAT(&batch,&g->submit,entries);
+    g->submit_event = 0;
+    pthread_mutex_unlock(&g->submit_lock);
+
+    while((di = TAILQ_FIRST(&batch))){
+        TAILQ_REMOVE(&batch,di,entries);
+        prio = di->req->priority;
+        if(prio < 0 || prio >= LWQQ_HTTP_PRIO_LENGTH)
+            prio = LWQQ_HTTP_PRIO_ROSTER;
+        TAILQ_INSERT_TAIL(&g->waiting[prio],di,entries);
+        di->state = DI_WAITING;
+        di->prio = prio;
+        g->stats.waiting[prio]++;
+        if(g->stats.waiting[prio] > g->stats.max_waiting[prio])
+            g->stats.max_waiting[prio] = g->stats.waiting[prio];
+        LwqqHttpStats* st = &(di->account = owner_get(g,di->req->owner))->stats;
+        st->waiting[prio]++;
+        if(st->waiting[prio] > st->max_waiting[prio])
+            st->max_waiting[prio] = st->waiting[prio];
     }
+    schedule_run(g);
+    if(g->timer_event){
+        purple_timeout_remove(g->timer_event);
+        g->timer_event = 0;
+    }
+    curl_multi_socket_action(g->multi,CURL_SOCKET_TIMEOUT,0,&g->still_running);
+    check_multi_info(g);
     return 0;
 }
-static LwqqAsyncEvent* lwqq_http_do_request_async(struct LwqqHttpRequest *request, int method,
-                                      char *body, LwqqAsyncCallback callback,
-                                      void *data)
+static void submit_handle(GLOBAL* g,D_ITEM* di)
+{
+    pthread_mutex_lock(&g->submit_lock);
+    TAILQ_INSERT_TAIL(&g->submit,di,entries);
+    di->state = DI_SUBMIT;
+    //first one in this iteration schedule the flush
+    if(g->submit_event == 0)
+        g->submit_event = purple_timeout_add(0,submit_flush,g);
+    pthread_mutex_unlock(&g->submit_lock);
+}
+/**
+ * reset the request and wrap it into a D_ITEM ready to be submitted.
+ * @return NULL if request can not be sent.
+ */
+static D_ITEM* request_prepare(LwqqHttpRequest* request,int method,char* body,
+        LwqqAsyncCallback callback,void* data)
 {
     if (!request->req)
         return NULL;
 
-    char **resp = &request->response;
-
     /* Clear off last response */
-    if (*resp) {
-        s_free(*resp);
-        *resp = NULL;
-        request->http_code = 0;
-        request->resp_len = 0;
-        curl_slist_free_all(request->recv_head);
-        request->recv_head = NULL;
-    }
+    resp_reset(request);
 
     /* Set http method */
     if (method==0){
@@ -565,45 +1726,202 @@ static LwqqAsyncEvent* lwqq_http_do_request_async(struct LwqqHttpRequest *reques
         curl_easy_setopt(request->req,CURLOPT_COPYPOSTFIELDS,body);
     } else {
         lwqq_log(LOG_WARNING, "Wrong http method\n");
-        goto failed;
+        return NULL;
     }
 
     if(global.multi == NULL){
-        lwqq_http_global_init();
+        global_setup();
+    }
+    if(global.multiplex){
+#if LIBCURL_VERSION_NUM >= 0x072f00
+        curl_easy_setopt(request->req,CURLOPT_HTTP_VERSION,CURL_HTTP_VERSION_2TLS);
+#endif
+#if LIBCURL_VERSION_NUM >= 0x072b00
+        //wait for a connection could be shared instead of open a new one
+        curl_easy_setopt(request->req,CURLOPT_PIPEWAIT,1L);
+#endif
     }
     D_ITEM* di = s_malloc0(sizeof(*di));
+    TAILQ_INIT(&di->followers);
     curl_easy_setopt(request->req,CURLOPT_PRIVATE,di);
     di->callback = callback;
     di->req = request;
     di->data = data;
+    di->method = method;
     di->event = lwqq_async_event_new();
-    purple_timeout_add(50,delay_add_handle,di);
+    di->queue_ms = now_ms();
+    //made here for every api, count it by endpoint instead
+    char* url = NULL;
+    char name[48];
+    curl_easy_getinfo(request->req,CURLINFO_EFFECTIVE_URL,&url);
+    if(url){
+        endpoint_name(url,name,sizeof(name));
+        lwqq_async_event_set_site(di->event,name);
+    }
+    lwqq_async_event_set_cancel(di->event,item_cancel,di);
+    pthread_mutex_lock(&global.item_lock);
+    LIST_INSERT_HEAD(&global.items,di,item_entries);
+    pthread_mutex_unlock(&global.item_lock);
+    return di;
+}
+static LwqqAsyncEvent* lwqq_http_do_request_async(struct LwqqHttpRequest *request, int method,
+                                      char *body, LwqqAsyncCallback callback,
+                                      void *data)
+{
+    D_ITEM* di = request_prepare(request,method,body,callback,data);
+    D_ITEM* leader;
+    if(di == NULL)
+        return NULL;
+    if(request->flight_key && method == 0){
+        pthread_mutex_lock(&global.flight_lock);
+        LIST_FOREACH(leader,&global.flights,flight_entries){
+            //responses carry cookies and session of the owner
+            if(leader->req->owner == request->owner &&
+                    strcmp(leader->req->flight_key,request->flight_key)==0)
+                break;
+        }
+        if(leader){
+            //ride on the running one, request is never sent
+            TAILQ_INSERT_TAIL(&leader->followers,di,entries);
+            di->state = DI_FOLLOWER;
+            di->leader = leader;
+            global.stats.coalesced++;
+            pthread_mutex_unlock(&global.flight_lock);
+            return di->event;
+        }
+        LIST_INSERT_HEAD(&global.flights,di,flight_entries);
+        di->in_flight = 1;
+        pthread_mutex_unlock(&global.flight_lock);
+    }
+    submit_handle(&global,di);
     return di->event;
-
-failed:
-    if (*resp) {
-        s_free(*resp);
-        *resp = NULL;
+}
+static void lwqq_http_set_single_flight(LwqqHttpRequest* request,const char* key)
+{
+    s_free(request->flight_key);
+    request->flight_key = key?s_strdup(key):NULL;
+}
+/**
+ * take item out of where it is and finish its event with result,
+ * LWQQ_EC_CANCELED or LWQQ_EC_TIMEOUT.
+ * callback is not called, request is freed here unless it is a sync one.
+ * run in main loop.
+ */
+static void item_cancel(void* data,int result)
+{
+    GLOBAL* g = &global;
+    D_ITEM* di = data;
+    D_ITEM* f;
+    switch(di->state){
+        case DI_NEW:
+            break;
+        case DI_SUBMIT:
+            pthread_mutex_lock(&g->submit_lock);
+            TAILQ_REMOVE(&g->submit,di,entries);
+            pthread_mutex_unlock(&g->submit_lock);
+            break;
+        case DI_WAITING:
+            TAILQ_REMOVE(&g->waiting[di->prio],di,entries);
+            g->stats.waiting[di->prio]--;
+            di->account->stats.waiting[di->prio]--;
+            break;
+        case DI_RUNNING:
+            curl_multi_remove_handle(g->multi,di->req->req);
+            schedule_done(g,di);
+            break;
+        case DI_RETRY:
+            purple_timeout_remove(di->retry_timer);
+            break;
+        case DI_FOLLOWER:
+            pthread_mutex_lock(&g->flight_lock);
+            TAILQ_REMOVE(&di->leader->followers,di,entries);
+            pthread_mutex_unlock(&g->flight_lock);
+            break;
     }
-    return NULL;
+    if(di->in_flight){
+        pthread_mutex_lock(&g->flight_lock);
+        LIST_REMOVE(di,flight_entries);
+        di->in_flight = 0;
+        //nobody answers followers now, send them by themselves
+        while((f = TAILQ_FIRST(&di->followers))){
+            TAILQ_REMOVE(&di->followers,f,entries);
+            f->leader = NULL;
+            f->state = DI_NEW;
+            pthread_mutex_unlock(&g->flight_lock);
+            submit_handle(g,f);
+            pthread_mutex_lock(&g->flight_lock);
+        }
+        pthread_mutex_unlock(&g->flight_lock);
+    }
+    di->result = CURLE_ABORTED_BY_CALLBACK;
+    if(di->callback != sync_back)
+        lwqq_http_request_free(di->req);
+    lwqq_async_event_set_result(di->event,result);
+    lwqq_async_event_finish(di->event);
+    item_free(di);
+}
+void lwqq_http_cancel_all(void* owner)
+{
+    D_ITEM* di;
+    int count = 0;
+    //cancel one by one, listener of a cancelled event may start new request
+    for(;;){
+        pthread_mutex_lock(&global.item_lock);
+        LIST_FOREACH(di,&global.items,item_entries){
+            if((owner == NULL || di->req->owner == owner) && di->state != DI_NEW)
+                break;
+        }
+        pthread_mutex_unlock(&global.item_lock);
+        if(di == NULL) break;
+        item_cancel(di,LWQQ_EC_CANCELED);
+        count++;
+    }
+    if(count)
+        lwqq_log(LOG_NOTICE,"%d requests cancelled\n",count);
+}
+/** sync request result is the transfer result */
+static int sync_back(LwqqHttpRequest* request,void* data)
+{
+    D_ITEM* di = data;
+    return di->result;
 }
+/** unknown main loop is taken as here, performing in place is safe */
+static int in_main_loop()
+{
+    return !global.main_known || pthread_equal(pthread_self(),global.main_thread);
+}
+/**
+ * when called outside main loop this is a thin wait on the multi engine,
+ * so sync requests share connections and scheduling with async ones.
+ * main loop thread can not wait itself, there it performs in place within
+ * LWQQ_HTTP_INPLACE_TIMEOUT, bypassing scheduler and per-client caps;
+ * counted as inplace. off main loop the wait ends after
+ * LWQQ_HTTP_SYNC_TIMEOUT.
+ * @return 0 if transfer finished, -1 when failed.
+ */
 static int lwqq_http_do_request(LwqqHttpRequest *request, int method, char *body)
 {
+    D_ITEM* di;
+    CURLcode ret;
+
+    if(!in_main_loop()){
+        di = request_prepare(request,method,body,sync_back,NULL);
+        if(di == NULL)
+            return -1;
+        di->data = di;
+        LwqqAsyncEvset* set = lwqq_async_evset_new();
+        //before submit, so scheduler makes it the transfer timeout
+        lwqq_async_evset_set_deadline(set,LWQQ_HTTP_SYNC_TIMEOUT);
+        lwqq_async_evset_add_event(set,di->event);
+        submit_handle(&global,di);
+        return lwqq_async_wait(set)?-1:0;
+    }
+
     if (!request->req)
         return -1;
 
-    int have_read_bytes = 0;
-    char **resp = &request->response;
-
     /* Clear off last response */
-    if (*resp) {
-        s_free(*resp);
-        *resp = NULL;
-        request->http_code = 0;
-        request->resp_len = 0;
-        curl_slist_free_all(request->recv_head);
-        request->recv_head = NULL;
-    }
+    resp_reset(request);
 
     /* Set http method */
     if (method==0){
@@ -612,104 +1930,342 @@ static int lwqq_http_do_request(LwqqHttpRequest *request, int method, char *body
         curl_easy_setopt(request->req,CURLOPT_COPYPOSTFIELDS,body);
     } else {
         lwqq_log(LOG_WARNING, "Wrong http method\n");
-        goto failed;
+        return -1;
     }
 
-    curl_easy_perform(request->req);
-    have_read_bytes = request->resp_len;
+    //can not wait multi here, it blocks main loop without scheduler
+    global.stats.inplace++;
+    lwqq_log(LOG_WARNING,"sync request in main loop, performed in place\n");
+    curl_easy_setopt(request->req,CURLOPT_TIMEOUT_MS,(long)LWQQ_HTTP_INPLACE_TIMEOUT);
+    ret = curl_easy_perform(request->req);
+    curl_easy_setopt(request->req,CURLOPT_TIMEOUT_MS,0L);
     curl_easy_getinfo(request->req,CURLINFO_RESPONSE_CODE,&request->http_code);
+    /* content already inflated in write_content */
+    inflate_end(request);
+    timing_record(&global,request,-1);
+    record_response(&global,request);
 
-    // NB: *response may null 
-    // jump it .that is no problem.
-    if (*resp == NULL) {
-        goto failed;
-    }
-
-    /* Uncompress data here if we have a Content-Encoding header */
-    const char *enc_type = NULL;
-    enc_type = lwqq_http_get_header(request, "Content-Encoding");
-    if (enc_type && strstr(enc_type, "gzip")) {
-        char *outdata;
-        int total = 0;
-        
-        outdata = ungzip(*resp, have_read_bytes, &total);
-        if (!outdata) {
-            goto failed;
-        }
-
-        s_free(*resp);
-        /* Update response data to uncompress data */
-        *resp = s_strdup(outdata);
-        s_free(outdata);
-        have_read_bytes = total;
-    }
-
-    return 0;
-
-failed:
-    if (*resp) {
-        s_free(*resp);
-        *resp = NULL;
-    }
-    return 0;
+    return (ret == CURLE_OK)?0:-1;
 }
+/**
+ * curl locks every data type it shares, including CURL_LOCK_DATA_SHARE
+ * for the share object itself. so lock whatever it asks for.
+ */
 static void share_lock(CURL* handle,curl_lock_data data,curl_lock_access access,void* userptr)
 {
-    //this is shared access.
-    //no need to lock it.
-    if(access == CURL_LOCK_ACCESS_SHARED) return;
     GLOBAL* g = userptr;
-    int idx;
-    if(data == CURL_LOCK_DATA_DNS) idx=0;
-    else if(data == CURL_LOCK_DATA_CONNECT) idx=1;
-    else return;
-    pthread_mutex_lock(&g->share_lock[idx]);
-
+    if(data < 0 || data >= CURL_LOCK_DATA_LAST) return;
+    if(access == CURL_LOCK_ACCESS_SHARED)
+        pthread_rwlock_rdlock(&g->share_lock[data]);
+    else
+        pthread_rwlock_wrlock(&g->share_lock[data]);
 }
 static void share_unlock(CURL* handle,curl_lock_data data,void* userptr)
 {
     GLOBAL* g = userptr;
-    int idx;
-    if(data == CURL_LOCK_DATA_DNS) idx=0;
-    else if(data == CURL_LOCK_DATA_CONNECT) idx=1;
-    else return;
-    pthread_mutex_unlock(&g->share_lock[idx]);
+    if(data < 0 || data >= CURL_LOCK_DATA_LAST) return;
+    pthread_rwlock_unlock(&g->share_lock[data]);
 }
-void lwqq_http_global_init()
+static void multiplex_apply(GLOBAL* g)
+{
+    long host = 0,total = 0;
+#if LIBCURL_VERSION_NUM >= 0x072b00
+    long mode = g->multiplex?CURLPIPE_HTTP1|CURLPIPE_MULTIPLEX:CURLPIPE_NOTHING;
+#else
+    long mode = g->multiplex;
+#endif
+    curl_multi_setopt(g->multi,CURLMOPT_PIPELINING,mode);
+    //0 means no limit, which is default of curl
+    if(g->multiplex){
+        host = g->max_host_connections;
+        total = g->max_total_connections;
+    }
+#if LIBCURL_VERSION_NUM >= 0x071e00
+    curl_multi_setopt(g->multi,CURLMOPT_MAX_HOST_CONNECTIONS,host);
+    curl_multi_setopt(g->multi,CURLMOPT_MAX_TOTAL_CONNECTIONS,total);
+#else
+    (void)host;(void)total;
+#endif
+}
+void lwqq_http_set_multiplex(int enable,int max_host_connections,
+        int max_total_connections)
+{
+    global.multiplex = enable;
+    if(max_host_connections > 0)
+        global.max_host_connections = max_host_connections;
+    if(max_total_connections > 0)
+        global.max_total_connections = max_total_connections;
+    if(global.multi) multiplex_apply(&global);
+}
+static void global_setup()
 {
     if(global.multi==NULL){
+        int i;
+        for(i=0;i<LWQQ_HTTP_PRIO_LENGTH;i++)
+            TAILQ_INIT(&global.waiting[i]);
+        LIST_INIT(&global.hosts);
         global.multi = curl_multi_init();
         curl_multi_setopt(global.multi,CURLMOPT_SOCKETFUNCTION,sock_cb);
         curl_multi_setopt(global.multi,CURLMOPT_SOCKETDATA,&global);
         curl_multi_setopt(global.multi, CURLMOPT_TIMERFUNCTION, multi_timer_cb);
         curl_multi_setopt(global.multi, CURLMOPT_TIMERDATA, &global);
+        multiplex_apply(&global);
     }
     if(global.share==NULL){
         global.share = curl_share_init();
         CURLSH* share = global.share;
-        curl_share_setopt(share,CURLSHOPT_SHARE,CURL_LOCK_DATA_DNS);
-        curl_share_setopt(share,CURLSHOPT_SHARE,CURL_LOCK_DATA_CONNECT);
+        int i;
+        for(i=0;i<CURL_LOCK_DATA_LAST;i++)
+            pthread_rwlock_init(&global.share_lock[i],NULL);
+        //locks must be set before any data is shared
         curl_share_setopt(share,CURLSHOPT_LOCKFUNC,share_lock);
         curl_share_setopt(share,CURLSHOPT_UNLOCKFUNC,share_unlock);
         curl_share_setopt(share,CURLSHOPT_USERDATA,&global);
-        pthread_mutex_init(&global.share_lock[0],NULL);
-        pthread_mutex_init(&global.share_lock[1],NULL);
+        curl_share_setopt(share,CURLSHOPT_SHARE,CURL_LOCK_DATA_DNS);
+        curl_share_setopt(share,CURLSHOPT_SHARE,CURL_LOCK_DATA_CONNECT);
+        //resume tls session instead of full handshake on https endpoints
+        curl_share_setopt(share,CURLSHOPT_SHARE,CURL_LOCK_DATA_SSL_SESSION);
+        //cookies are not shared: every request sends lwqq cookies in its own
+        //Cookie header, the curl cookie engine would send them twice.
+        header_tmpl_build(&global);
+    }
+}
+void lwqq_http_global_init()
+{
+    global.main_thread = pthread_self();
+    global.main_known = 1;
+    global_setup();
+}
+void lwqq_http_set_base_url(const char* base_url)
+{
+    s_free(global.base_url);
+    global.base_url = NULL;
+    if(base_url && *base_url){
+        global.base_url = s_strdup(base_url);
+        //avoid double slash
+        size_t len = strlen(global.base_url);
+        if(global.base_url[len-1] == '/')
+            global.base_url[len-1] = '\0';
     }
 }
+void lwqq_http_set_record_dir(const char* dir)
+{
+    s_free(global.record_dir);
+    global.record_dir = (dir && *dir)?s_strdup(dir):NULL;
+}
+void lwqq_http_scheduler_config(int max_running,int max_per_host)
+{
+    if(max_running > 0) global.max_running = max_running;
+    if(max_per_host > 0) global.max_per_host = max_per_host;
+    if(global.multi) schedule_run(&global);
+}
+void lwqq_http_get_stats(LwqqHttpStats* stats)
+{
+    if(stats) *stats = global.stats;
+}
+void lwqq_http_get_client_stats(void* owner,LwqqHttpStats* stats)
+{
+    OWNER_ITEM* item;
+    if(stats == NULL) return;
+    memset(stats,0,sizeof(*stats));
+    LIST_FOREACH(item,&global.owners,entries){
+        if(item->owner == owner){
+            *stats = item->stats;
+            return;
+        }
+    }
+}
+void lwqq_http_set_client_limit(void* owner,int max_running)
+{
+    owner_get(&global,owner)->max_running = max_running>0?max_running:0;
+    if(global.multi) schedule_run(&global);
+}
+void lwqq_http_client_attach(void* owner)
+{
+    global.clients++;
+    lwqq_http_global_init();
+    owner_get(&global,owner);
+}
+void lwqq_http_client_detach(void* owner)
+{
+    OWNER_ITEM* item;
+    lwqq_http_cancel_all(owner);
+    LIST_FOREACH(item,&global.owners,entries){
+        if(item->owner == owner){
+            LIST_REMOVE(item,entries);
+            s_free(item);
+            break;
+        }
+    }
+    if(global.clients > 0 && --global.clients == 0)
+        lwqq_http_global_free();
+}
 void lwqq_http_global_free()
 {
+    if(global.multi)
+        lwqq_http_cancel_all(NULL);
+    easy_pool_clean();
+    if(global.submit_event){
+        purple_timeout_remove(global.submit_event);
+        global.submit_event = 0;
+    }
+    if(global.timer_event){
+        purple_timeout_remove(global.timer_event);
+        global.timer_event = 0;
+    }
     if(global.multi){
         curl_multi_cleanup(global.multi);
         global.multi = NULL;
     }
+    ENDPOINT_STAT* st;
+    pthread_mutex_lock(&global.stat_lock);
+    while((st = LIST_FIRST(&global.endpoints))){
+        LIST_REMOVE(st,entries);
+        s_free(st);
+    }
+    global.endpoint_count = 0;
+    pthread_mutex_unlock(&global.stat_lock);
+    HOST_ITEM* host;
+    while((host = LIST_FIRST(&global.hosts))){
+        LIST_REMOVE(host,entries);
+        s_free(host->host);
+        s_free(host);
+    }
+    OWNER_ITEM* owner;
+    while((owner = LIST_FIRST(&global.owners))){
+        LIST_REMOVE(owner,entries);
+        s_free(owner);
+    }
+    global.running = 0;
     if(global.share){
+        int i;
         curl_share_cleanup(global.share);
         global.share = NULL;
-        pthread_mutex_destroy(&global.share_lock[0]);
-        pthread_mutex_destroy(&global.share_lock[1]);
+        for(i=0;i<CURL_LOCK_DATA_LAST;i++)
+            pthread_rwlock_destroy(&global.share_lock[i]);
+        header_tmpl_free(&global);
     }
 }
 
+static const char* content_type(const char* filename,const char* extension)
+{
+    if(extension == NULL && filename != NULL){
+        extension = strrchr(filename,'.');
+        if(extension !=NULL) extension++;
+    }
+    if(extension == NULL) return NULL;
+    if(strcmp(extension,"jpg")==0||strcmp(extension,"jpeg")==0)
+        return "image/jpeg";
+    else if(strcmp(extension,"png")==0)
+        return "image/png";
+    else if(strcmp(extension,"gif")==0)
+        return "image/gif";
+    else if(strcmp(extension,"bmp")==0)
+        return "image/bmp";
+    return NULL;
+}
+static HTTP_STREAM* stream_new(int fd,const char* data,size_t size)
+{
+    HTTP_STREAM* st = s_malloc0(sizeof(*st));
+    st->fd = fd;
+    st->data = data;
+    st->size = size;
+    return st;
+}
+static void stream_free(void* data)
+{
+    HTTP_STREAM* st = data;
+    if(st->mapped)
+        munmap((void*)st->data,st->size);
+    if(st->fd >= 0)
+        close(st->fd);
+    s_free(st);
+}
+/** streams not owned by a mime part */
+static void stream_free_all(LwqqHttpRequest* request)
+{
+    HTTP_STREAM* st = request->streams;
+    HTTP_STREAM* next;
+    while(st){
+        next = st->next;
+        stream_free(st);
+        st = next;
+    }
+    request->streams = NULL;
+}
+#if LWQQ_HTTP_MIME
+static size_t stream_read(char* buf,size_t size,size_t nitems,void* data)
+{
+    HTTP_STREAM* st = data;
+    size_t len = size*nitems;
+    if(len > st->size-st->offset) len = st->size-st->offset;
+    if(len == 0) return 0;
+    if(st->fd < 0){
+        memcpy(buf,st->data+st->offset,len);
+    }else{
+        ssize_t n = pread(st->fd,buf,len,st->offset);
+        if(n <= 0){
+            lwqq_log(LOG_ERROR,"read upload file failed\n");
+            return CURL_READFUNC_ABORT;
+        }
+        len = n;
+    }
+    st->offset += len;
+    return len;
+}
+/** called when request is retried or redirected */
+static int stream_seek(void* data,curl_off_t offset,int origin)
+{
+    HTTP_STREAM* st = data;
+    if(origin != SEEK_SET || offset < 0 || (size_t)offset > st->size)
+        return CURL_SEEKFUNC_CANTSEEK;
+    st->offset = offset;
+    return CURL_SEEKFUNC_OK;
+}
+static curl_mimepart* mime_addpart(LwqqHttpRequest* request,const char* name)
+{
+    if(request->mime == NULL)
+        request->mime = curl_mime_init(request->req);
+    curl_mimepart* part = curl_mime_addpart(request->mime);
+    curl_mime_name(part,name);
+    curl_easy_setopt(request->req,CURLOPT_MIMEPOST,request->mime);
+    return part;
+}
+/** mime part owns st and free it with mime */
+static void mime_add_stream(LwqqHttpRequest* request,const char* name,
+        const char* filename,HTTP_STREAM* st,const char* extension)
+{
+    curl_mimepart* part = mime_addpart(request,name);
+    curl_mime_data_cb(part,st->size,stream_read,stream_seek,stream_free,st);
+    curl_mime_filename(part,filename);
+    curl_mime_type(part,content_type(filename,extension));
+}
+
+static void lwqq_http_add_form(LwqqHttpRequest* request,LWQQ_FORM form,const char* name,const char* value)
+{
+    curl_mimepart* part = mime_addpart(request,name);
+    switch(form){
+        case LWQQ_FORM_FILE:
+            curl_mime_filedata(part,value);
+            break;
+        case LWQQ_FORM_CONTENT:
+            curl_mime_data(part,value,CURL_ZERO_TERMINATED);
+            break;
+    }
+}
+static void lwqq_http_add_file_content(LwqqHttpRequest* request,const char* name,
+        const char* filename,const void* data,size_t size,const char* extension)
+{
+    //curl_mime_data would copy it
+    mime_add_stream(request,name,filename,stream_new(-1,data,size),extension);
+}
+static int lwqq_http_add_file_fd(LwqqHttpRequest* request,const char* name,
+        const char* filename,int fd,size_t size,const char* extension)
+{
+    mime_add_stream(request,name,filename,stream_new(fd,NULL,size),extension);
+    return 0;
+}
+#else
 static void lwqq_http_add_form(LwqqHttpRequest* request,LWQQ_FORM form,const char* name,const char* value)
 {
     struct curl_httppost** post = (struct curl_httppost**)&request->form_start;
@@ -729,23 +2285,7 @@ static void lwqq_http_add_file_content(LwqqHttpRequest* request,const char* name
 {
     struct curl_httppost** post = (struct curl_httppost**)&request->form_start;
     struct curl_httppost** last = (struct curl_httppost**)&request->form_end;
-    char *type = NULL;
-    if(extension == NULL){
-        extension = strrchr(filename,'.');
-        if(extension !=NULL) extension++;
-    }
-    if(extension == NULL) type = NULL;
-    else{
-        if(strcmp(extension,"jpg")==0||strcmp(extension,"jpeg")==0)
-            type = "image/jpeg";
-        else if(strcmp(extension,"png")==0)
-            type = "image/png";
-        else if(strcmp(extension,"gif")==0)
-            type = "image/gif";
-        else if(strcmp(extension,"bmp")==0)
-            type = "image/bmp";
-        else type = NULL;
-    }
+    const char *type = content_type(filename,extension);
     if(type==NULL){
         curl_formadd(post,last,
                 CURLFORM_COPYNAME,name,
@@ -754,8 +2294,7 @@ static void lwqq_http_add_file_content(LwqqHttpRequest* request,const char* name
                 CURLFORM_BUFFERLENGTH,size,
                 CURLFORM_END);
     }else{
-        CURLFORMcode rc;
-        rc = curl_formadd(post,last,
+        curl_formadd(post,last,
                 CURLFORM_COPYNAME,name,
                 CURLFORM_BUFFER,filename,
                 CURLFORM_BUFFERPTR,data,
@@ -766,4 +2305,57 @@ static void lwqq_http_add_file_content(LwqqHttpRequest* request,const char* name
     curl_easy_setopt(request->req,CURLOPT_HTTPPOST,request->form_start);
     //curl_easy_setopt(request->req,CURLOPT_VERBOSE,1);
 }
+/**
+ * form stream can't be rewound when request is retried, map the file
+ * instead. pages are read in by kernel when libcurl sends them.
+ */
+static int lwqq_http_add_file_fd(LwqqHttpRequest* request,const char* name,
+        const char* filename,int fd,size_t size,const char* extension)
+{
+    void* map = mmap(NULL,size,PROT_READ,MAP_PRIVATE,fd,0);
+    if(map == MAP_FAILED){
+        lwqq_log(LOG_ERROR,"mmap upload file failed\n");
+        close(fd);
+        return -1;
+    }
+    HTTP_STREAM* st = stream_new(fd,map,size);
+    st->mapped = 1;
+    st->next = request->streams;
+    request->streams = st;
+    lwqq_http_add_file_content(request,name,filename,map,size,extension);
+    return 0;
+}
+#endif
+#if LIBCURL_VERSION_NUM >= 0x072000
+static int progress_cb(void* data,curl_off_t dltotal,curl_off_t dlnow,
+        curl_off_t ultotal,curl_off_t ulnow)
+#else
+static int progress_cb(void* data,double dltotal,double dlnow,
+        double ultotal,double ulnow)
+#endif
+{
+    LwqqHttpRequest* request = data;
+    //report upload while sending body, then download
+    if(ultotal > 0 && ulnow < ultotal)
+        request->progress(request->progress_data,ulnow,ultotal);
+    else if(ultotal > 0 && dltotal <= 0)
+        request->progress(request->progress_data,ultotal,ultotal);
+    else
+        request->progress(request->progress_data,dlnow,dltotal);
+    return 0;
+}
+static void lwqq_http_set_progress(LwqqHttpRequest* request,
+        LwqqProgressFunc func,void* data)
+{
+    request->progress = func;
+    request->progress_data = data;
+    curl_easy_setopt(request->req,CURLOPT_NOPROGRESS,func?0L:1L);
+#if LIBCURL_VERSION_NUM >= 0x072000
+    curl_easy_setopt(request->req,CURLOPT_XFERINFOFUNCTION,func?progress_cb:NULL);
+    curl_easy_setopt(request->req,CURLOPT_XFERINFODATA,request);
+#else
+    curl_easy_setopt(request->req,CURLOPT_PROGRESSFUNCTION,func?progress_cb:NULL);
+    curl_easy_setopt(request->req,CURLOPT_PROGRESSDATA,request);
+#endif
+}
 
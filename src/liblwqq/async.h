@@ -9,6 +9,7 @@
  */
 #ifndef LWQQ_ASYNC_H
 #define LWQQ_ASYNC_H
+#include <stdio.h>
 #include "type.h"
 
 /**@param data this is special data passed by liblwqq.
@@ -33,9 +34,18 @@ typedef struct _LwqqAsync {
     ASYNC_CALLBACK listener[ListenerTypeLength];
     LwqqErrorCode err[ListenerTypeLength];
     void* data[ListenerTypeLength];
+    /**@brief dispatched listener calls, drained by one source */
+    TAILQ_HEAD(,async_dispatch_data) queue;
+    pthread_mutex_t lock;
+    int drain_event;
+    int budget_ms;
 } _LwqqAsync;
 /**set async enabled or disabled*/
 void lwqq_async_set(LwqqClient* client,int enabled);
+/** set time spent on dispatched listeners per main loop iteration.
+ * @param budget_ms 0 to use the default
+ */
+void lwqq_async_set_dispatch_budget(LwqqClient* lc,int budget_ms);
 /** check if async enabled*/
 #define lwqq_async_enabled(lc) (lc->async!=NULL)
 /** add a ASYNC_CALLBACK type listener.*/
@@ -69,9 +79,18 @@ typedef struct _LwqqAsyncEvset LwqqAsyncEvset;
 typedef void (*EVENT_CALLBACK)(LwqqAsyncEvent* event,void* data);
 typedef void (*EVSET_CALLBACK)(int result,void* data);
 /** return a new evset. a evset can link multi of event.
- * you can wait a evset. means it would block ultil all event is finished
+ * you can wait a evset. means it would block ultil all event is finished.
+ * it is freed by lwqq_async_wait, so it must be waited.
  */
 #define lwqq_async_evset_new() lwqq_async_evset_new_with_debug(__FILE__,__LINE__)
+/** return a evset which can not be waited, only its listener is called.
+ * it has no lock: events are counted atomically.
+ * lwqq_async_add_evset_listener must be called once after all events are
+ * added, the evset is freed after listener is called.
+ */
+#define lwqq_async_evset_new_callback() \
+    lwqq_async_evset_new_callback_with_debug(__FILE__,__LINE__)
+LwqqAsyncEvset* lwqq_async_evset_new_callback_with_debug(const char* file,int line);
 LwqqAsyncEvent* lwqq_async_event_new_with_debug(const char* file,int line);
 /** return a new event. 
  * you can wait a event by use evset or LWQQ_SYNC macro simply.
@@ -98,6 +117,23 @@ void lwqq_async_evset_add_event(LwqqAsyncEvset* host,LwqqAsyncEvent *handle);
  * it can only store one error number.
  */
 int lwqq_async_wait(LwqqAsyncEvset* host);
+/**
+ * wait evset at most timeout_ms, or until deadline set before.
+ * on timeout events which can be cancelled finish with LWQQ_EC_TIMEOUT
+ * in main loop before it returns, others finish later and the last one
+ * frees evset. do not call it in main loop.
+ * @param timeout_ms 0 means only the deadline set before, if any
+ * @return LWQQ_EC_TIMEOUT when timed out, or result of evset
+ */
+int lwqq_async_wait_timeout(LwqqAsyncEvset* host,int timeout_ms);
+/** set deadline of evset, best before requests are issued and added.
+ * events added get it: a http request not started yet uses the time left
+ * as its transfer timeout. events already running are cancelled at the
+ * deadline by the waiter instead.
+ */
+void lwqq_async_evset_set_deadline(LwqqAsyncEvset* host,int timeout_ms);
+/** @return ms left to deadline of event, -1 if it has no deadline */
+int lwqq_async_event_time_left(LwqqAsyncEvent* event);
 /** this add a event listener to a event.
  * it is better than lwqq_async_add_listener.
  * because you can set different data to different event which may the same function.
@@ -106,6 +142,15 @@ int lwqq_async_wait(LwqqAsyncEvset* host);
 void lwqq_async_add_event_listener(LwqqAsyncEvent* event,EVENT_CALLBACK callback,void* data);
 
 void lwqq_async_add_evset_listener(LwqqAsyncEvset* evset,EVSET_CALLBACK callback,void* data);
+/** let the one who finishes event stop it early, used by http layer.
+ * the hook is dropped when event finishes.
+ */
+void lwqq_async_event_set_cancel(LwqqAsyncEvent* event,void (*cancel)(void* data,int result),void* data);
+/** cancel a unfinished event, it finishes with LWQQ_EC_CANCELED.
+ * call it in main loop.
+ * @return 0 if cancelled, -1 if event can not be cancelled
+ */
+int lwqq_async_event_cancel(LwqqAsyncEvent* event);
 /** this set the errno for a event.
  * it is a hack code.
  * ensure LwqqAsyncEvent first member is a int.
@@ -118,6 +163,70 @@ do{\
 #define lwqq_async_event_get_result(ev) (*((int*)ev))
 #define lwqq_async_evset_get_result(ev) (*((int*)ev))
 
+/** counters of event and evset freelists */
+typedef struct LwqqAsyncPoolStats {
+    unsigned long event_alloc;  ///< events got from malloc
+    unsigned long event_reused; ///< events got from freelist
+    int event_live;             ///< events not finished yet
+    int event_idle;             ///< events in freelist
+    unsigned long evset_alloc;
+    unsigned long evset_reused;
+    int evset_live;
+    int evset_idle;
+} LwqqAsyncPoolStats;
+void lwqq_async_pool_stats(LwqqAsyncPoolStats* stats);
+/** free idle events and evsets in freelist */
+void lwqq_async_pool_clean();
+
+/**===================FUTURE API=========================================**/
+/** called when the event it waits finishes.
+ * @param result result of that event
+ * @return next event to wait, or NULL to finish with result.
+ */
+typedef LwqqAsyncEvent* (*THEN_CALLBACK)(int result,void* data);
+/** chain a stage after event without blocking a thread.
+ * callback is called with event result even it failed, so it can clean
+ * up; return NULL then and the error is passed to returned event.
+ * note it takes the listener of event.
+ * @param event NULL is taken as a failed event
+ * @return event finishes after callback and the event it returns
+ */
+LwqqAsyncEvent* lwqq_async_then(LwqqAsyncEvent* event,THEN_CALLBACK callback,void* data);
+/** @return event finishes when all events finished, its result is one
+ * of the errors. NULL in events is taken as a failed event.
+ */
+LwqqAsyncEvent* lwqq_async_all(LwqqAsyncEvent** events,int count);
+/** @return event finishes with the result of first finished event.
+ * note it takes the listener of every event.
+ */
+LwqqAsyncEvent* lwqq_async_any(LwqqAsyncEvent** events,int count);
+
+/**===================REGISTRY API=======================================**/
+/** track live events and evsets with their creation time and callsite.
+ * only objects made after it is enabled are tracked.
+ */
+void lwqq_async_registry_enable(int enable);
+/** count event under name instead of where it was made,
+ * e.g. the http endpoint it waits for.
+ */
+void lwqq_async_event_set_site(LwqqAsyncEvent* event,const char* name);
+/** dump objects alive longer than stuck_ms and completion latency
+ * histogram of every callsite.
+ */
+void lwqq_async_registry_dump(FILE* f,int stuck_ms);
+
+/**===================TIMER API==========================================**/
+/** called in main loop.
+ * @return nonzero to keep the timer, 0 to remove it
+ */
+typedef int (*TIMER_CALLBACK)(void* data);
+/** call callback after ms milliseconds, it can be called in any thread.
+ * @return timer id
+ */
+int lwqq_async_timer_add(int ms,TIMER_CALLBACK callback,void* data);
+/** remove a timer which is not fired yet */
+void lwqq_async_timer_remove(int timer);
+
 /** this is a easy and useful macro.
  * it can keep sync for one function.
  * it is simple. it create one evset and add only one event.
@@ -131,6 +240,17 @@ do{\
         lwqq_async_evset_add_event(evset,event);\
         lwqq_async_wait(evset);\
     }while(0)
+/** same as LWQQ_SYNC, but give up after timeout_ms.
+ * @param ret int set to result, LWQQ_EC_TIMEOUT when timed out
+ */
+#define LWQQ_SYNC_TIMEOUT(ev,timeout_ms,ret) \
+    do{\
+        LwqqAsyncEvset* evset = lwqq_async_evset_new();\
+        lwqq_async_evset_set_deadline(evset,timeout_ms);\
+        LwqqAsyncEvent* event = ev;\
+        lwqq_async_evset_add_event(evset,event);\
+        ret = lwqq_async_wait(evset);\
+    }while(0)
 
 
 #endif
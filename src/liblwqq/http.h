@@ -11,16 +11,55 @@
 #ifndef LWQQ_HTTP_H
 #define LWQQ_HTTP_H
 
+#include <stdio.h>
 #include "type.h"
 
 struct LwqqHttpRequest;
 typedef int (*LwqqAsyncCallback)(struct LwqqHttpRequest* request, void* data);
+/** transfer progress, upload while sending body then download */
+typedef void (*LwqqProgressFunc)(void* data, size_t now, size_t total);
 
+/** Cookie received in response, memory belongs to the request */
 struct cookie_list {
-    char name[32];
-    char value[256];
+    char* name;
+    char* value;
+    char* domain;
+    char* path;
     struct cookie_list* next;
 };
+/**
+ * Priority class of async request, smaller is more urgent.
+ * SEND and POLL are never held by scheduler, others are limited by
+ * running requests in total and per host.
+ */
+typedef enum {
+    LWQQ_HTTP_PRIO_SEND,    ///< interactive: send message, user actions
+    LWQQ_HTTP_PRIO_POLL,
+    LWQQ_HTTP_PRIO_ROSTER,  ///< default
+    LWQQ_HTTP_PRIO_AVATAR,
+    LWQQ_HTTP_PRIO_BULK,    ///< e.g. qqnumber of every buddy
+    LWQQ_HTTP_PRIO_LENGTH
+} LwqqHttpPriority;
+/**
+ * endpoint class of prebuilt header template, every template has the
+ * default headers and what its endpoints need (Referer, Origin ...).
+ */
+typedef enum {
+    LWQQ_HTTP_HEADER_DEFAULT,
+    LWQQ_HTTP_HEADER_POLL,      ///< d.web2 poll
+    LWQQ_HTTP_HEADER_SEND,      ///< d.web2 send message
+    LWQQ_HTTP_HEADER_INFO,      ///< s.web2 query
+    LWQQ_HTTP_HEADER_CHANGE,    ///< s.web2 modify info
+    LWQQ_HTTP_HEADER_UPLOAD,    ///< web2 upload
+    LWQQ_HTTP_HEADER_LENGTH
+} LwqqHttpHeaderClass;
+typedef struct LwqqHttpStats {
+    int waiting[LWQQ_HTTP_PRIO_LENGTH];     ///< queue depth now
+    int max_waiting[LWQQ_HTTP_PRIO_LENGTH]; ///< max queue depth ever seen
+    int running;                            ///< running background requests
+    unsigned long coalesced;                ///< requests answered by a same one in flight
+    unsigned long inplace;                  ///< sync requests performed in main loop
+} LwqqHttpStats;
 typedef enum {
     LWQQ_FORM_FILE,// use add_file_content instead
     LWQQ_FORM_CONTENT
@@ -33,10 +72,23 @@ typedef enum {
 typedef struct LwqqHttpRequest {
     void *req;
     void *header;// read and write.
-    void *recv_head;
+    void *header_tmpl;// shared tail of header, never freed by request
+    LwqqCookieHeader *cookie_header;// referenced by a header node
+    void *recv_head;// parsed response header table
     struct cookie_list* cookie;
     void *form_start;
     void *form_end;
+    void *mime;// curl_mime of libcurl >= 7.56, replaces form
+    void *streams;// upload files not owned by form
+    LwqqProgressFunc progress;
+    void *progress_data;
+    char *host;
+    char *flight_key;
+    void *owner;// requests of a owner are cancelled together
+    /* Priority class used by async request, default LWQQ_HTTP_PRIO_ROSTER */
+    LwqqHttpPriority priority;
+    /* POST is retried only when this is set, GET always may be */
+    int idempotent;
 
     /**
      * Http code return from server. e.g. 200, 404, this maybe changed
@@ -47,9 +99,22 @@ typedef struct LwqqHttpRequest {
     /* Server response, used when do async request */
     char *response;
 
-    /* Response length, NB: the response may not terminate with '\0' */
+    /**
+     * Response length, response is inflated already and always terminated
+     * with '\0' which is not counted in resp_len, so binary data is safe.
+     */
     int resp_len;
-    int resp_realloc;
+    /**
+     * Allocated size of response, and the max size of response allowed,
+     * a larger response is dropped. resp_max 0 means default limit.
+     */
+    size_t resp_cap;
+    size_t resp_max;
+    /* Recycled buffer, would be used when response arrive */
+    char *resp_spare;
+    size_t spare_cap;
+    /* zlib stream used while receiving compressed content */
+    void *inflate;
 
     /**
      * Send a request to server, method is GET(0) or POST(1), if we make a
@@ -72,8 +137,23 @@ typedef struct LwqqHttpRequest {
     void (*set_default_header)(struct LwqqHttpRequest *request);
 
     /**
-     * Get header, return a alloca memory, so caller has responsibility
-     * free the memory
+     * Use prebuilt headers of a endpoint class instead of default headers,
+     * call it before set_header. set_header of a header in template
+     * makes a private copy of template.
+     */
+    void (*set_header_template)(struct LwqqHttpRequest *request,
+            LwqqHttpHeaderClass cls);
+
+    /**
+     * Send a cookie snapshot without copying it, request takes the
+     * reference of h, h can be NULL.
+     */
+    void (*set_cookie_header)(struct LwqqHttpRequest *request,
+            LwqqCookieHeader *h);
+
+    /**
+     * Get response header, name is case insensitive. The return value
+     * belongs to request, it is valid until next request or free.
      */
     const char * (*get_header)(struct LwqqHttpRequest *request, const char *name);
 
@@ -85,6 +165,21 @@ typedef struct LwqqHttpRequest {
 
     void (*add_form)(struct LwqqHttpRequest* request,LWQQ_FORM form,const char* name,const char* content);
     void (*add_file_content)(struct LwqqHttpRequest* request,const char* name,const char* filename,const void* data,size_t size,const char* extension);
+    /**
+     * Upload size bytes of fd as a file part, the content is read when it
+     * is sent instead of loaded into memory. request takes fd and close it.
+     * @return 0 on success
+     */
+    int (*add_file_fd)(struct LwqqHttpRequest* request,const char* name,const char* filename,int fd,size_t size,const char* extension);
+    /* Report transfer progress, func NULL to disable */
+    void (*set_progress)(struct LwqqHttpRequest* request,LwqqProgressFunc func,void* data);
+    /**
+     * Async GET with a key is not sent while a request with same key is
+     * in flight, it gets a copy of that response (body, code and headers)
+     * instead. callback must be safe to run more than once.
+     * only requests of the same client are coalesced.
+     */
+    void (*set_single_flight)(struct LwqqHttpRequest* request,const char* key);
 
 } LwqqHttpRequest;
 
@@ -116,9 +211,97 @@ LwqqHttpRequest *lwqq_http_request_new(const char *uri);
 LwqqHttpRequest *lwqq_http_create_default_request(const char *url,
         LwqqErrorCode *err);
 
+/**
+ * Same as lwqq_http_create_default_request, the request belongs to lc
+ * and is cancelled by lwqq_http_cancel_all(lc).
+ */
+LwqqHttpRequest *lwqq_http_create_client_request(LwqqClient* lc,const char *url,
+        LwqqErrorCode *err);
+/**
+ * cancel every unfinished request of owner, each event finishes with
+ * LWQQ_EC_CANCELED and its callback is not called. call it in main loop,
+ * e.g. before the client is freed.
+ * @param owner NULL to cancel all requests
+ */
+void lwqq_http_cancel_all(void* owner);
+
 void lwqq_http_set_async(LwqqHttpRequest* request);
+/** call it in main loop: sync requests of other threads then wait on the
+ * shared engine, ones of main loop are performed in place.
+ * lwqq_http_client_attach calls it.
+ */
 void lwqq_http_global_init();
 void lwqq_http_global_free();
+/**
+ * every account shares one engine (multi, connection cache, dns, tls
+ * sessions). attach when account logs in, detach when it closes: only
+ * requests of that owner are cancelled, the engine is freed when the
+ * last account detached.
+ */
+void lwqq_http_client_attach(void* owner);
+void lwqq_http_client_detach(void* owner);
+/**
+ * limit running background requests of one owner, so a busy account
+ * can not take all slots of the shared engine.
+ * @param max_running 0 means no limit besides the global one
+ */
+void lwqq_http_set_client_limit(void* owner,int max_running);
+/** get queue depth and running requests of one owner */
+void lwqq_http_get_client_stats(void* owner,LwqqHttpStats* stats);
+/**
+ * config the easy handle pool.
+ * pooled handle keep their connection alive, so next request
+ * to same host would reuse it.
+ * @param max_size max idle handles kept. 0 disable pool. -1 keep old value
+ * @param idle_expire seconds a idle handle kept. -1 keep old value
+ */
+void lwqq_http_pool_config(int max_size,int idle_expire);
+/**
+ * config the async request scheduler.
+ * @param max_running max running background requests. 0 keep old value
+ * @param max_per_host max running background requests to one host.
+ *        0 keep old value
+ */
+void lwqq_http_scheduler_config(int max_running,int max_per_host);
+/**
+ * enable http/1.1 pipelining or http/2 multiplexing on the shared multi
+ * handle, so requests to same host share few connections. disabled by
+ * default, old libcurl may only support part of it.
+ * @param max_host_connections max connections to one host when enabled.
+ *        0 keep old value
+ * @param max_total_connections max connections in total when enabled.
+ *        0 keep old value
+ */
+void lwqq_http_set_multiplex(int enable,int max_host_connections,
+        int max_total_connections);
+/**
+ * set retry policy of a priority class. transient failures (network error,
+ * http 5xx, 408, 429) of GET, or of POST marked idempotent, are retried
+ * with capped exponential backoff and jitter, callback only see the final
+ * result.
+ * @param max_retry 0 disable retry
+ * @param base_ms delay of first retry. 0 keep old value
+ * @param max_ms max delay. 0 keep old value
+ */
+void lwqq_http_set_retry_policy(LwqqHttpPriority prio,int max_retry,int base_ms,int max_ms);
+/** get queue depth of scheduler */
+void lwqq_http_get_stats(LwqqHttpStats* stats);
+/**
+ * dump timing histograms of every endpoint (e.g. poll2, getface),
+ * queue, dns, connect, tls, first byte and total time are recorded.
+ */
+void lwqq_http_timing_dump(FILE* f);
+/**
+ * send every request to a local stand-in server instead of webqq.
+ * http://d.web2.qq.com/channel/poll2 is sent as <base_url>/d.web2.qq.com/channel/poll2
+ * @param base_url e.g. http://127.0.0.1:8080, NULL or "" to disable
+ */
+void lwqq_http_set_base_url(const char* base_url);
+/**
+ * save every response body to <dir>/<endpoint> (e.g. dir/poll2),
+ * it can be replayed by mock server. NULL or "" to disable
+ */
+void lwqq_http_set_record_dir(const char* dir);
 
 
 #endif  /* LWQQ_HTTP_H */
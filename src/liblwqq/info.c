@@ -272,7 +272,6 @@ LwqqAsyncEvent* lwqq_info_get_friends_info(LwqqClient *lc, LwqqErrorCode *err)
 {
     char msg[256] = {0};
     LwqqHttpRequest *req = NULL;
-    char *cookies;
 
     /* Create post data: {"h":"hello","vfwebqq":"4354j53h45j34"} */
     create_post_data(lc, msg, sizeof(msg));
@@ -280,18 +279,12 @@ LwqqAsyncEvent* lwqq_info_get_friends_info(LwqqClient *lc, LwqqErrorCode *err)
     /* Create a POST request */
     char url[512];
     snprintf(url, sizeof(url), "%s/api/get_user_friends2", "http://s.web2.qq.com");
-    req = lwqq_http_create_default_request(url, err);
+    req = lwqq_http_create_client_request(lc, url, err);
     if (!req) {
         goto done;
     }
-    req->set_header(req, "Referer", "http://s.web2.qq.com/proxy.html?v=20101025002");
-    req->set_header(req, "Content-Transfer-Encoding", "binary");
-    req->set_header(req, "Content-type", "application/x-www-form-urlencoded");
-    cookies = lwqq_get_cookies(lc);
-    if (cookies) {
-        req->set_header(req, "Cookie", cookies);
-        s_free(cookies);
-    }
+    req->set_header_template(req,LWQQ_HTTP_HEADER_INFO);
+    req->set_cookie_header(req, lwqq_get_cookie_header(lc));
     return req->do_request_async(req, 1, msg,get_friends_info_back,lc);
 
     /**
@@ -393,7 +386,6 @@ void lwqq_info_get_avatar(LwqqClient* lc,int isgroup,void* grouporbuddy)
     //we send request if possible with modify time
     //to reduce download rate
     LwqqHttpRequest* req;
-    char* cookies;
     char url[512];
     char host[32];
     int type = (isgroup)?4:1;
@@ -403,7 +395,7 @@ void lwqq_info_get_avatar(LwqqClient* lc,int isgroup,void* grouporbuddy)
     snprintf(url, sizeof(url),
              "http://%s/cgi/svr/face/getface?cache=0&type=%d&fid=0&uin=%s&vfwebqq=%s",
              host,type,uin, lc->vfwebqq);
-    req = lwqq_http_create_default_request(url, &error);
+    req = lwqq_http_create_client_request(lc, url, &error);
     if (!req) {
         goto done;
     }
@@ -417,15 +409,15 @@ void lwqq_info_get_avatar(LwqqClient* lc,int isgroup,void* grouporbuddy)
         strftime(buf,sizeof(buf),"%a, %d %b %Y %H:%M:%S GMT",localtime_r(&modify,&modify_tm) );
         req->set_header(req,"If-Modified-Since",buf);
     }
-    cookies = lwqq_get_cookies(lc);
-    if (cookies) {
-        req->set_header(req, "Cookie", cookies);
-        s_free(cookies);
-    }
+    req->set_cookie_header(req, lwqq_get_cookie_header(lc));
+    //host rotates, key by the face itself and who asks it
+    snprintf(url, sizeof(url), "getface:%s:%d:%s", lc->username, type, uin);
+    req->set_single_flight(req, url);
     void** array = s_malloc0(sizeof(void*)*4);
     array[0] = lc;
     array[1] = buddy;
     array[2] = group;
+    req->priority = LWQQ_HTTP_PRIO_AVATAR;
     req->do_request_async(req, 0, NULL,get_avatar_back,array);
 done:
     return;
@@ -462,6 +454,7 @@ static int get_avatar_back(LwqqHttpRequest* req,void* data)
     //our cache outdate
     if(req->http_code != 304) {
         //we 'move' it instead of copy it
+        s_free(*avatar);
         *avatar = req->response;
         *len = req->resp_len;
         req->response = NULL;
@@ -479,13 +472,15 @@ static int get_avatar_back(LwqqHttpRequest* req,void* data)
             fclose(f);
             //we read last modify time from response header
             struct tm wtm = {0};
-            strptime(req->get_header(req,"Last-Modified"),
-                    "%a, %d %b %Y %H:%M:%S GMT",&wtm);
-            //and write it to file
-            struct utimbuf wutime;
-            wutime.modtime = mktime(&wtm);
-            wutime.actime = wutime.modtime;//it is not important
-            utime(path,&wutime);
+            const char* last_modified = req->get_header(req,"Last-Modified");
+            if(last_modified &&
+                    strptime(last_modified,"%a, %d %b %Y %H:%M:%S GMT",&wtm)){
+                //and write it to file
+                struct utimbuf wutime;
+                wutime.modtime = mktime(&wtm);
+                wutime.actime = wutime.modtime;//it is not important
+                utime(path,&wutime);
+            }
         }
         lwqq_http_request_free(req);
         if(isgroup)lwqq_async_dispatch(lc,GROUP_AVATAR,group);
@@ -496,11 +491,11 @@ static int get_avatar_back(LwqqHttpRequest* req,void* data)
 done:
     //failed or we do not need update
     //we read from file
-    if(hasfile){
-        f = fopen(path,"r");
+    if(hasfile && (f = fopen(path,"r"))){
+        s_free(*avatar);
         *avatar = s_malloc(filesize);
-        fread(*avatar,1,filesize,f);
-        *len = filesize;
+        *len = fread(*avatar,1,filesize,f);
+        fclose(f);
     }
     lwqq_http_request_free(req);
     if(isgroup)lwqq_async_dispatch(lc,GROUP_AVATAR,group);
@@ -605,25 +600,18 @@ LwqqAsyncEvent* lwqq_info_get_group_name_list(LwqqClient *lc, LwqqErrorCode *err
     char msg[256];
     char url[512];
     LwqqHttpRequest *req = NULL;
-    char *cookies;
 
     /* Create post data: {"h":"hello","vfwebqq":"4354j53h45j34"} */
     create_post_data(lc, msg, sizeof(msg));
 
     /* Create a POST request */
     snprintf(url, sizeof(url), "%s/api/get_group_name_list_mask2", "http://s.web2.qq.com");
-    req = lwqq_http_create_default_request(url, err);
+    req = lwqq_http_create_client_request(lc, url, err);
     if (!req) {
         goto done;
     }
-    req->set_header(req, "Referer", "http://s.web2.qq.com/proxy.html?v=20101025002");
-    req->set_header(req, "Content-Transfer-Encoding", "binary");
-    req->set_header(req, "Content-type", "application/x-www-form-urlencoded");
-    cookies = lwqq_get_cookies(lc);
-    if (cookies) {
-        req->set_header(req, "Cookie", cookies);
-        s_free(cookies);
-    }
+    req->set_header_template(req,LWQQ_HTTP_HEADER_INFO);
+    req->set_cookie_header(req, lwqq_get_cookie_header(lc));
     return req->do_request_async(req, 1, msg,get_group_name_list_back,lc);
 done:
     lwqq_http_request_free(req);
@@ -839,6 +827,13 @@ static void parse_groups_minfo_child(LwqqClient *lc, LwqqGroup *group,  json_t *
         if (!uin || !nick)
             continue;
 
+        /* detail may be fetched again, update the member we have */
+        member = lwqq_group_find_group_member_by_uin(group, uin);
+        if (member) {
+            s_free(member->nick);
+            member->nick = s_strdup(nick);
+            continue;
+        }
         member = lwqq_buddy_new();
 
         member->uin = s_strdup(uin);
@@ -888,6 +883,8 @@ static void parse_groups_stats_child(LwqqClient *lc, LwqqGroup *group,  json_t *
         member = lwqq_group_find_group_member_by_uin(group, uin);
         if (!member)
             continue;
+        s_free(member->client_type);
+        s_free(member->stat);
         member->client_type = s_strdup(json_parse_simple_value(cur, "client_type"));
         member->stat = s_strdup(json_parse_simple_value(cur, "stat"));
 
@@ -909,7 +906,6 @@ LwqqAsyncEvent* lwqq_info_get_group_detail_info(LwqqClient *lc, LwqqGroup *group
     char url[512];
     LwqqHttpRequest *req = NULL;
     int ret;
-    char *cookies;
 
     if (!lc || ! group) {
         return NULL;
@@ -926,18 +922,13 @@ LwqqAsyncEvent* lwqq_info_get_group_detail_info(LwqqClient *lc, LwqqGroup *group
     snprintf(url, sizeof(url),
              "%s/api/get_group_info_ext2?gcode=%s&vfwebqq=%s",
              "http://s.web2.qq.com", group->code, lc->vfwebqq);
-    req = lwqq_http_create_default_request(url, err);
+    req = lwqq_http_create_client_request(lc, url, err);
     if (!req) {
         goto done;
     }
-    req->set_header(req, "Referer", "http://s.web2.qq.com/proxy.html?v=20101025002");
-    req->set_header(req, "Content-Transfer-Encoding", "binary");
-    req->set_header(req, "Content-type", "utf-8");
-    cookies = lwqq_get_cookies(lc);
-    if (cookies) {
-        req->set_header(req, "Cookie", cookies);
-        s_free(cookies);
-    }
+    req->set_header_template(req,LWQQ_HTTP_HEADER_INFO);
+    req->set_cookie_header(req, lwqq_get_cookie_header(lc));
+    req->set_single_flight(req, url);
     void **data = s_malloc0(sizeof(void*)*2);
     data[0] = lc;
     data[1] = group;
@@ -1041,7 +1032,6 @@ static LwqqAsyncEvent* get_friend_qqnumber(LwqqClient *lc, const char *uin)
     LwqqHttpRequest *req = NULL;
     json_t *json = NULL;
     //char *qqnumber = NULL;
-    char *cookies;
 
     if (!lc || ! uin) {
         return NULL;
@@ -1053,18 +1043,13 @@ static LwqqAsyncEvent* get_friend_qqnumber(LwqqClient *lc, const char *uin)
     snprintf(url, sizeof(url),
              "%s/api/get_friend_uin2?tuin=%s&verifysession=&type=1&code=&vfwebqq=%s",
              "http://s.web2.qq.com", uin, lc->vfwebqq);
-    req = lwqq_http_create_default_request(url, NULL);
+    req = lwqq_http_create_client_request(lc, url, NULL);
     if (!req) {
         goto done;
     }
-    req->set_header(req, "Referer", "http://s.web2.qq.com/proxy.html?v=20101025002");
-    req->set_header(req, "Content-Transfer-Encoding", "binary");
-    req->set_header(req, "Content-type", "utf-8");
-    cookies = lwqq_get_cookies(lc);
-    if (cookies) {
-        req->set_header(req, "Cookie", cookies);
-        s_free(cookies);
-    }
+    req->set_header_template(req,LWQQ_HTTP_HEADER_INFO);
+    req->set_cookie_header(req, lwqq_get_cookie_header(lc));
+    req->priority = LWQQ_HTTP_PRIO_BULK;
     return req->do_request_async(req, 0, NULL,get_friend_qqnumber_back,lc);
 done:
     /* Free temporary string */
@@ -1140,48 +1125,15 @@ done:
  * @param buddy
  * @param err
  */
-void lwqq_info_get_friend_detail_info(LwqqClient *lc, LwqqBuddy *buddy,
-                                      LwqqErrorCode *err)
+static int get_friend_detail_info_back(LwqqHttpRequest* req,void* data)
 {
-    lwqq_log(LOG_DEBUG, "in function.");
-
-    char url[512];
-    LwqqHttpRequest *req = NULL;
-    int ret;
+    LwqqBuddy* buddy = data;
     json_t *json = NULL, *json_tmp;
-    char *cookies;
-
-    if (!lc || ! buddy) {
-        return ;
-    }
-
-    /* Make sure we know uin. */
-    if (!buddy->uin) {
-        if (err)
-            *err = LWQQ_EC_NULL_POINTER;
-        return ;
-    }
+    int ret;
+    int err = 0;
 
-    /* Create a GET request */
-    snprintf(url, sizeof(url),
-             "%s/api/get_friend_info2?tuin=%s&verifysession=&code=&vfwebqq=%s",
-             "http://s.web2.qq.com", buddy->uin, lc->vfwebqq);
-    req = lwqq_http_create_default_request(url, err);
-    if (!req) {
-        goto done;
-    }
-    req->set_header(req, "Referer", "http://s.web2.qq.com/proxy.html?v=20101025002");
-    req->set_header(req, "Content-Transfer-Encoding", "binary");
-    req->set_header(req, "Content-type", "utf-8");
-    cookies = lwqq_get_cookies(lc);
-    if (cookies) {
-        req->set_header(req, "Cookie", cookies);
-        s_free(cookies);
-    }
-    ret = req->do_request(req, 0, NULL);
-    if (ret || req->http_code != 200) {
-        if (err)
-            *err = LWQQ_EC_HTTP_ERROR;
+    if (req->http_code != 200) {
+        err = LWQQ_EC_HTTP_ERROR;
         goto done;
     }
 
@@ -1200,15 +1152,15 @@ void lwqq_info_get_friend_detail_info(LwqqClient *lc, LwqqBuddy *buddy,
     ret = json_parse_document(&json, req->response);
     if (ret != JSON_OK) {
         lwqq_log(LOG_ERROR, "Parse json object of groups error: %s\n", req->response);
-        if (err)
-            *err = LWQQ_EC_ERROR;
+        err = LWQQ_EC_ERROR;
         goto done;
     }
 
     json_tmp = get_result_json_object(json);
     if (!json_tmp) {
         lwqq_log(LOG_ERROR, "Parse json object error: %s\n", req->response);
-        goto json_error;
+        err = LWQQ_EC_ERROR;
+        goto done;
     }
 
     /** It seems everything is ok, we start parsing information
@@ -1254,20 +1206,42 @@ void lwqq_info_get_friend_detail_info(LwqqClient *lc, LwqqBuddy *buddy,
 #undef SET_BUDDY_INFO
     }
 
-
 done:
     if (json)
         json_free_value(&json);
     lwqq_http_request_free(req);
-    return ;
+    return err;
+}
+LwqqAsyncEvent* lwqq_info_get_friend_detail_info(LwqqClient *lc, LwqqBuddy *buddy,
+                                      LwqqErrorCode *err)
+{
+    lwqq_log(LOG_DEBUG, "in function.");
 
-json_error:
-    if (err)
-        *err = LWQQ_EC_ERROR;
-    /* Free temporary string */
-    if (json)
-        json_free_value(&json);
-    lwqq_http_request_free(req);
+    char url[512];
+    LwqqHttpRequest *req = NULL;
+
+    if (!lc || ! buddy) {
+        return NULL;
+    }
+
+    /* Make sure we know uin. */
+    if (!buddy->uin) {
+        if (err)
+            *err = LWQQ_EC_NULL_POINTER;
+        return NULL;
+    }
+
+    /* Create a GET request */
+    snprintf(url, sizeof(url),
+             "%s/api/get_friend_info2?tuin=%s&verifysession=&code=&vfwebqq=%s",
+             "http://s.web2.qq.com", buddy->uin, lc->vfwebqq);
+    req = lwqq_http_create_client_request(lc, url, err);
+    if (!req) {
+        return NULL;
+    }
+    req->set_header_template(req,LWQQ_HTTP_HEADER_INFO);
+    req->set_cookie_header(req, lwqq_get_cookie_header(lc));
+    return req->do_request_async(req, 0, NULL,get_friend_detail_info_back,buddy);
 }
 
 static void update_online_buddies(LwqqClient *lc, json_t *json)
@@ -1312,7 +1286,6 @@ LwqqAsyncEvent* lwqq_info_get_online_buddies(LwqqClient *lc, LwqqErrorCode *err)
 {
     char url[512];
     LwqqHttpRequest *req = NULL;
-    char *cookies;
 
     if (!lc) {
         return NULL;
@@ -1322,18 +1295,12 @@ LwqqAsyncEvent* lwqq_info_get_online_buddies(LwqqClient *lc, LwqqErrorCode *err)
     snprintf(url, sizeof(url),
              "%s/channel/get_online_buddies2?clientid=%s&psessionid=%s",
              "http://d.web2.qq.com", lc->clientid, lc->psessionid);
-    req = lwqq_http_create_default_request(url, err);
+    req = lwqq_http_create_client_request(lc, url, err);
     if (!req) {
         goto done;
     }
-    req->set_header(req, "Referer", "http://d.web2.qq.com/proxy.html?v=20101025002");
-    req->set_header(req, "Content-Transfer-Encoding", "binary");
-    req->set_header(req, "Content-type", "utf-8");
-    cookies = lwqq_get_cookies(lc);
-    if (cookies) {
-        req->set_header(req, "Cookie", cookies);
-        s_free(cookies);
-    }
+    req->set_header_template(req,LWQQ_HTTP_HEADER_POLL);
+    req->set_cookie_header(req, lwqq_get_cookie_header(lc));
     return req->do_request_async(req, 0, NULL,get_online_buddies_back,lc);
 done:
     lwqq_http_request_free(req);
@@ -1400,19 +1367,19 @@ LwqqAsyncEvent* lwqq_info_change_buddy_markname(LwqqClient* lc,LwqqBuddy* buddy,
     char url[512];
     char post[256];
     snprintf(url,sizeof(url),"%s/api/change_mark_name2","http://s.web2.qq.com");
-    LwqqHttpRequest* req = lwqq_http_create_default_request(url,NULL);
+    LwqqHttpRequest* req = lwqq_http_create_client_request(lc,url,NULL);
     if(req==NULL){
         goto done;
     }
     snprintf(post,sizeof(post),"tuin=%s&markname=%s&vfwebqq=%s",
             buddy->uin,alias,lc->vfwebqq
             );
-    req->set_header(req,"Origin","http://s.web2.qq.com");
-    req->set_header(req,"Referer","http://s.web2.qq.com/proxy.html?v=20110412001&callback=0&id=3");
+    req->set_header_template(req,LWQQ_HTTP_HEADER_CHANGE);
     void** data = s_malloc0(sizeof(void*)*3);
     data[0] = (void*)CHANGE_BUDDY_MARKNAME;
     data[1] = buddy;
     data[2] = s_strdup(alias);
+    req->priority = LWQQ_HTTP_PRIO_SEND;
     return req->do_request_async(req,1,post,change_buddy_markname_back,data);
 done:
     lwqq_http_request_free(req);
@@ -1476,7 +1443,7 @@ LwqqAsyncEvent* lwqq_info_change_group_markname(LwqqClient* lc,LwqqGroup* group,
     char url[512];
     char post[256];
     snprintf(url,sizeof(url),"%s/api/update_group_info2","http://s.web2.qq.com");
-    LwqqHttpRequest* req = lwqq_http_create_default_request(url,NULL);
+    LwqqHttpRequest* req = lwqq_http_create_client_request(lc,url,NULL);
     if(req==NULL){
         goto done;
     }
@@ -1484,12 +1451,12 @@ LwqqAsyncEvent* lwqq_info_change_group_markname(LwqqClient* lc,LwqqGroup* group,
             group->code,alias,lc->vfwebqq
             );
     puts(post);
-    req->set_header(req,"Origin","http://s.web2.qq.com");
-    req->set_header(req,"Referer","http://s.web2.qq.com/proxy.html?v=20110412001&callback=0&id=3");
+    req->set_header_template(req,LWQQ_HTTP_HEADER_CHANGE);
     void** data = s_malloc0(sizeof(void*)*3);
     data[0] = (void*)CHANGE_GROUP_MARKNAME;
     data[1] = group;
     data[2] = s_strdup(alias);
+    req->priority = LWQQ_HTTP_PRIO_SEND;
     return req->do_request_async(req,1,post,change_buddy_markname_back,data);
 done:
     lwqq_http_request_free(req);
@@ -1510,21 +1477,21 @@ LwqqAsyncEvent* lwqq_info_modify_buddy_category(LwqqClient* lc,LwqqBuddy* buddy,
     char url[512];
     char post[256];
     snprintf(url,sizeof(url),"%s/api/modify_friend_group","http://s.web2.qq.com");
-    LwqqHttpRequest* req = lwqq_http_create_default_request(url,NULL);
+    LwqqHttpRequest* req = lwqq_http_create_client_request(lc,url,NULL);
     if(req==NULL){
         goto done;
     }
     snprintf(post,sizeof(post),"tuin=%s&newid=%d&vfwebqq=%s",
             buddy->uin,cate_idx,lc->vfwebqq );
     puts(post);
-    req->set_header(req,"Origin","http://s.web2.qq.com");
-    req->set_header(req,"Referer","http://s.web2.qq.com/proxy.html?v=20110412001&callback=0&id=3");
+    req->set_header_template(req,LWQQ_HTTP_HEADER_CHANGE);
     void** data = s_malloc0(sizeof(void*)*3);
     data[0] = (void*)MODIFY_BUDDY_CATEGORY;
     data[1] = buddy;
     char* cate_index = s_malloc0(11);
     snprintf(cate_index,11,"%d",cate_idx);
     data[2] = cate_index;
+    req->priority = LWQQ_HTTP_PRIO_SEND;
     return req->do_request_async(req,1,post,change_buddy_markname_back,data);
 done:
     lwqq_http_request_free(req);
@@ -1537,15 +1504,15 @@ LwqqAsyncEvent* lwqq_info_delete_friend(LwqqClient* lc,LwqqBuddy* buddy,LWQQ_DEL
     char url[512];
     char post[256];
     snprintf(url,sizeof(url),"%s/api/delete_friend","http://s.web2.qq.com");
-    LwqqHttpRequest* req = lwqq_http_create_default_request(url,NULL);
+    LwqqHttpRequest* req = lwqq_http_create_client_request(lc,url,NULL);
     if(req==NULL){
         goto done;
     }
     snprintf(post,sizeof(post),"tuin=%s&delType=%d&vfwebqq=%s",
             buddy->uin,del_type,lc->vfwebqq );
     puts(post);
-    req->set_header(req,"Origin","http://s.web2.qq.com");
-    req->set_header(req,"Referer","http://s.web2.qq.com/proxy.html?v=20110412001&callback=0&id=3");
+    req->set_header_template(req,LWQQ_HTTP_HEADER_CHANGE);
+    req->priority = LWQQ_HTTP_PRIO_SEND;
     return req->do_request_async(req,1,post,change_buddy_markname_back,NULL);
 done:
     lwqq_http_request_free(req);
@@ -1559,15 +1526,15 @@ LwqqAsyncEvent* lwqq_info_allow_added_request(LwqqClient* lc,const char* account
     char url[512];
     char post[256];
     snprintf(url,sizeof(url),"%s/api/allow_added_request2","http://s.web2.qq.com");
-    LwqqHttpRequest* req = lwqq_http_create_default_request(url,NULL);
+    LwqqHttpRequest* req = lwqq_http_create_client_request(lc,url,NULL);
     if(req==NULL){
         goto done;
     }
     snprintf(post,sizeof(post),"r={\"account\":%s,\"vfwebqq\":\"%s\"}",
             account,lc->vfwebqq );
     puts(post);
-    req->set_header(req,"Origin","http://s.web2.qq.com");
-    req->set_header(req,"Referer","http://s.web2.qq.com/proxy.html?v=20110412001&callback=0&id=3");
+    req->set_header_template(req,LWQQ_HTTP_HEADER_CHANGE);
+    req->priority = LWQQ_HTTP_PRIO_SEND;
     return req->do_request_async(req,1,post,change_buddy_markname_back,NULL);
 done:
     lwqq_http_request_free(req);
@@ -1580,7 +1547,7 @@ LwqqAsyncEvent* lwqq_info_deny_added_request(LwqqClient* lc,const char* account,
     char url[512];
     char post[256];
     snprintf(url,sizeof(url),"%s/api/deny_added_request2","http://s.web2.qq.com");
-    LwqqHttpRequest* req = lwqq_http_create_default_request(url,NULL);
+    LwqqHttpRequest* req = lwqq_http_create_client_request(lc,url,NULL);
     if(req==NULL){
         goto done;
     }
@@ -1591,8 +1558,8 @@ LwqqAsyncEvent* lwqq_info_deny_added_request(LwqqClient* lc,const char* account,
     }
     format_append(post,"}");
     puts(post);
-    req->set_header(req,"Origin","http://s.web2.qq.com");
-    req->set_header(req,"Referer","http://s.web2.qq.com/proxy.html?v=20110412001&callback=0&id=3");
+    req->set_header_template(req,LWQQ_HTTP_HEADER_CHANGE);
+    req->priority = LWQQ_HTTP_PRIO_SEND;
     return req->do_request_async(req,1,post,change_buddy_markname_back,NULL);
 done:
     lwqq_http_request_free(req);
@@ -1604,7 +1571,7 @@ LwqqAsyncEvent* lwqq_info_allow_and_add(LwqqClient* lc,const char* account,const
     char url[512];
     char post[256];
     snprintf(url,sizeof(url),"%s/api/allow_and_add2","http://s.web2.qq.com");
-    LwqqHttpRequest* req = lwqq_http_create_default_request(url,NULL);
+    LwqqHttpRequest* req = lwqq_http_create_client_request(lc,url,NULL);
     if(req==NULL){
         goto done;
     }
@@ -1615,8 +1582,8 @@ LwqqAsyncEvent* lwqq_info_allow_and_add(LwqqClient* lc,const char* account,const
     }
     format_append(post,"}");
     puts(post);
-    req->set_header(req,"Origin","http://s.web2.qq.com");
-    req->set_header(req,"Referer","http://s.web2.qq.com/proxy.html?v=20110412001&callback=0&id=3");
+    req->set_header_template(req,LWQQ_HTTP_HEADER_CHANGE);
+    req->priority = LWQQ_HTTP_PRIO_SEND;
     return req->do_request_async(req,1,post,change_buddy_markname_back,NULL);
 done:
     lwqq_http_request_free(req);
@@ -39,7 +39,7 @@ LwqqAsyncEvent* lwqq_info_get_group_name_list(LwqqClient *lc, LwqqErrorCode *err
  * @param buddy 
  * @param err 
  */
-void lwqq_info_get_friend_detail_info(LwqqClient *lc, LwqqBuddy *buddy,
+LwqqAsyncEvent* lwqq_info_get_friend_detail_info(LwqqClient *lc, LwqqBuddy *buddy,
                                       LwqqErrorCode *err);
 /**
  * Store QQ face to LwqqBuddy::avatar
@@ -29,6 +29,7 @@
 #include "md5.h"
 #include "url.h"
 #include "json.h"
+#include "async.h"
 
 /* URL for webqq login */
 #define LWQQ_URL_LOGIN_HOST "http://ptlogin2.qq.com"
@@ -40,8 +41,8 @@
 
 /* URL for get webqq version */
 #define LWQQ_URL_VERSION "http://ui.ptlogin2.qq.com/cgi-bin/ver"
-
-static void set_online_status(LwqqClient *lc, char *status, LwqqErrorCode *err);
+/** sync login gives up after this ms */
+#define LWQQ_LOGIN_TIMEOUT 60000
 
 /** 
  * Update the cookies needed by webqq
@@ -49,7 +50,7 @@ static void set_online_status(LwqqClient *lc, char *status, LwqqErrorCode *err);
  * @param req  
  * @param key 
  * @param value 
- * @param update_cache Weather update lwcookies member
+ * @param update_cache Weather rebuild cookie header
  */
 static void update_cookies(LwqqCookies *cookies, LwqqHttpRequest *req,
                            const char *key, int update_cache)
@@ -62,78 +63,9 @@ static void update_cookies(LwqqCookies *cookies, LwqqHttpRequest *req,
     char *value = req->get_cookie(req, key);
     if (!value)
         return ;
-    
-#define FREE_AND_STRDUP(a, b)                   \
-    if (a)                                      \
-        s_free(a);                              \
-    a = s_strdup(b);
-    
-    if (!strcmp(key, "ptvfsession")) {
-        FREE_AND_STRDUP(cookies->ptvfsession, value);
-    } else if (!strcmp(key, "ptcz")) {
-        FREE_AND_STRDUP(cookies->ptcz, value);
-    } else if (!strcmp(key, "skey")) {
-        FREE_AND_STRDUP(cookies->skey, value);
-    } else if (!strcmp(key, "ptwebqq")) {
-        FREE_AND_STRDUP(cookies->ptwebqq, value);
-    } else if (!strcmp(key, "ptuserinfo")) {
-        FREE_AND_STRDUP(cookies->ptuserinfo, value);
-    } else if (!strcmp(key, "uin")) {
-        FREE_AND_STRDUP(cookies->uin, value);
-    } else if (!strcmp(key, "ptisp")) {
-        FREE_AND_STRDUP(cookies->ptisp, value);
-    } else if (!strcmp(key, "pt2gguin")) {
-        FREE_AND_STRDUP(cookies->pt2gguin, value);
-    } else if (!strcmp(key, "verifysession")) {
-        FREE_AND_STRDUP(cookies->verifysession, value);
-    } else {
-        lwqq_log(LOG_WARNING, "No this cookie: %s\n", key);
-    }
-    s_free(value);
 
-    if (update_cache) {
-        char buf[4096] = {0};           /* 4K is enough for cookies. */
-        int buflen = 0;
-        if (cookies->ptvfsession) {
-            snprintf(buf, sizeof(buf), "ptvfsession=%s; ", cookies->ptvfsession);
-            buflen = strlen(buf);
-        }
-        if (cookies->ptcz) {
-            snprintf(buf + buflen, sizeof(buf) - buflen, "ptcz=%s; ", cookies->ptcz);
-            buflen = strlen(buf);
-        }
-        if (cookies->skey) {
-            snprintf(buf + buflen, sizeof(buf) - buflen, "skey=%s; ", cookies->skey);
-            buflen = strlen(buf);
-        }
-        if (cookies->ptwebqq) {
-            snprintf(buf + buflen, sizeof(buf) - buflen, "ptwebqq=%s; ", cookies->ptwebqq);
-            buflen = strlen(buf);
-        }
-        if (cookies->ptuserinfo) {
-            snprintf(buf + buflen, sizeof(buf) - buflen, "ptuserinfo=%s; ", cookies->ptuserinfo);
-            buflen = strlen(buf);
-        }
-        if (cookies->uin) {
-            snprintf(buf + buflen, sizeof(buf) - buflen, "uin=%s; ", cookies->uin);
-            buflen = strlen(buf);
-        }
-        if (cookies->ptisp) {
-            snprintf(buf + buflen, sizeof(buf) - buflen, "ptisp=%s; ", cookies->ptisp);
-            buflen = strlen(buf);
-        }
-        if (cookies->pt2gguin) {
-            snprintf(buf + buflen, sizeof(buf) - buflen, "pt2gguin=%s; ", cookies->pt2gguin);
-            buflen = strlen(buf);
-        }
-        if (cookies->verifysession) {
-            snprintf(buf + buflen, sizeof(buf) - buflen, "verifysession=%s; ", cookies->verifysession);
-            buflen = strlen(buf);
-        }
-        
-        FREE_AND_STRDUP(cookies->lwcookies, buf);
-    }
-#undef FREE_AND_STRDUP
+    lwqq_cookies_update(cookies, key, value, update_cache);
+    s_free(value);
 }
 
 // ptui_checkVC('0','!IJG, ptui_checkVC('0','!IJG', '\x00\x00\x00\x00\x54\xb3\x3c\x53');
@@ -156,30 +88,18 @@ static char *parse_verify_uin(const char *str)
     return s_strdup(uin);
 }
 
-static void get_verify_code(LwqqClient *lc, LwqqErrorCode *err)
+static int get_verify_code_back(LwqqHttpRequest* req,void* data)
 {
-    LwqqHttpRequest *req;
-    char url[512];
+    LwqqClient* lc = data;
     char response[256];
-    int ret;
-    char chkuin[64];
+    int err = LWQQ_EC_OK;
 
-    snprintf(url, sizeof(url), "%s%s?uin=%s&appid=%s", LWQQ_URL_CHECK_HOST,
-             VCCHECKPATH, lc->username, APPID);
-    req = lwqq_http_create_default_request(url, err);
-    if (!req) {
-        goto failed;
-    }
-    
-    snprintf(chkuin, sizeof(chkuin), "chkuin=%s", lc->username);
-    req->set_header(req, "Cookie", chkuin);
-    ret = req->do_request(req, 0, NULL);
-    if (ret) {
-        *err = LWQQ_EC_NETWORK_ERROR;
+    if (req->http_code == 0) {
+        err = LWQQ_EC_NETWORK_ERROR;
         goto failed;
     }
     if (req->http_code != 200) {
-        *err = LWQQ_EC_HTTP_ERROR;
+        err = LWQQ_EC_HTTP_ERROR;
         goto failed;
     }
 
@@ -201,12 +121,12 @@ static void get_verify_code(LwqqClient *lc, LwqqErrorCode *err)
     char *c = strstr(response, "ptui_checkVC");
     char *s;
     if (!c) {
-        *err = LWQQ_EC_HTTP_ERROR;
+        err = LWQQ_EC_HTTP_ERROR;
         goto failed;
     }
     c = strchr(response, '\'');
     if (!c) {
-        *err = LWQQ_EC_HTTP_ERROR;
+        err = LWQQ_EC_HTTP_ERROR;
         goto failed;
     }
     c++;
@@ -248,39 +168,39 @@ static void get_verify_code(LwqqClient *lc, LwqqErrorCode *err)
         lc->vc->type = s_strdup("1");
         // ptui_checkVC('1','7ea19f6d3d2794eb4184c9ae860babf3b9c61441520c6df0', '\x00\x00\x00\x00\x04\x7e\x73\xb2');
         lc->vc->str = s_strdup(s);
-        *err = LWQQ_EC_LOGIN_NEED_VC;
+        err = LWQQ_EC_LOGIN_NEED_VC;
         lwqq_log(LOG_NOTICE, "We need verify code image: %s\n", lc->vc->str);
     }
     
-    lwqq_http_request_free(req);
-    return ;
-    
 failed:
     lwqq_http_request_free(req);
+    return err;
 }
-
-static void get_verify_image(LwqqClient *lc)
+static LwqqAsyncEvent* get_verify_code(LwqqClient *lc, LwqqErrorCode *err)
 {
-    LwqqHttpRequest *req = NULL;  
+    LwqqHttpRequest *req;
     char url[512];
-    int ret;
     char chkuin[64];
-    char image_file[256];
-    int image_length = 0;
-    LwqqErrorCode err;
- 
-    snprintf(url, sizeof(url), LWQQ_URL_VERIFY_IMG, APPID, lc->username);
-    req = lwqq_http_create_default_request(url, &err);
+
+    snprintf(url, sizeof(url), "%s%s?uin=%s&appid=%s", LWQQ_URL_CHECK_HOST,
+             VCCHECKPATH, lc->username, APPID);
+    req = lwqq_http_create_client_request(lc, url, err);
     if (!req) {
-        goto failed;
+        return NULL;
     }
-     
+    
     snprintf(chkuin, sizeof(chkuin), "chkuin=%s", lc->username);
     req->set_header(req, "Cookie", chkuin);
-    ret = req->do_request(req, 0, NULL);
-    if (ret) {
-        goto failed;
-    }
+    return req->do_request_async(req, 0, NULL, get_verify_code_back, lc);
+}
+
+static int get_verify_image_back(LwqqHttpRequest* req,void* data)
+{
+    LwqqClient* lc = data;
+    int ret;
+    char image_file[256];
+    int image_length = 0;
+ 
     if (req->http_code != 200) {
         goto failed;
     }
@@ -308,6 +228,24 @@ static void get_verify_image(LwqqClient *lc)
  
 failed:
     lwqq_http_request_free(req);
+    return 0;
+}
+static LwqqAsyncEvent* get_verify_image(LwqqClient *lc)
+{
+    LwqqHttpRequest *req = NULL;  
+    char url[512];
+    char chkuin[64];
+    LwqqErrorCode err;
+ 
+    snprintf(url, sizeof(url), LWQQ_URL_VERIFY_IMG, APPID, lc->username);
+    req = lwqq_http_create_client_request(lc, url, &err);
+    if (!req) {
+        return NULL;
+    }
+     
+    snprintf(chkuin, sizeof(chkuin), "chkuin=%s", lc->username);
+    req->set_header(req, "Cookie", chkuin);
+    return req->do_request_async(req, 0, NULL, get_verify_image_back, lc);
 }
  
 
@@ -402,54 +340,25 @@ static int sava_cookie(LwqqClient *lc, LwqqHttpRequest *req, LwqqErrorCode *err)
     return 0;
 }
 
-/** 
- * Do really login
- * 
- * @param lc 
- * @param md5 The md5 calculated from calculate_password_md5() 
- * @param err 
- */
-static void do_login(LwqqClient *lc, const char *md5, LwqqErrorCode *err)
+static int do_login_back(LwqqHttpRequest* req,void* data)
 {
-    char url[1024];
-    LwqqHttpRequest *req;
+    LwqqClient* lc = data;
     char *response = NULL;
-    char *cookies;
-    int ret;
-    
-    snprintf(url, sizeof(url), "%s/login?u=%s&p=%s&verifycode=%s&"
-             "webqq_type=10&remember_uin=1&aid=1003903&login2qq=1&"
-             "u1=http%%3A%%2F%%2Fweb.qq.com%%2Floginproxy.html"
-             "%%3Flogin2qq%%3D1%%26webqq_type%%3D10&h=1&ptredirect=0&"
-             "ptlang=2052&from_ui=1&pttype=1&dumy=&fp=loginerroralert&"
-             "action=2-11-7438&mibao_css=m_webqq&t=1&g=1", LWQQ_URL_LOGIN_HOST, lc->username, md5, lc->vc->str);
+    int err = LWQQ_EC_OK;
 
-    req = lwqq_http_create_default_request(url, err);
-    if (!req) {
-        goto done;
-    }
-    /* Setup http header */
-    cookies = lwqq_get_cookies(lc);
-    if (cookies) {
-        req->set_header(req, "Cookie", cookies);
-        s_free(cookies);
-    }
-
-    /* Send request */
-    ret = req->do_request(req, 0, NULL);
-    if (ret) {
-        *err = LWQQ_EC_NETWORK_ERROR;
+    if (req->http_code == 0) {
+        err = LWQQ_EC_NETWORK_ERROR;
         goto done;
     }
     if (req->http_code != 200) {
-        *err = LWQQ_EC_HTTP_ERROR;
+        err = LWQQ_EC_HTTP_ERROR;
         goto done;
     }
 
     response = req->response;
     char *p = strstr(response, "\'");
     if (!p) {
-        *err = LWQQ_EC_ERROR;
+        err = LWQQ_EC_ERROR;
         goto done;
     }
     char buf[4] = {0};
@@ -459,60 +368,86 @@ static void do_login(LwqqClient *lc, const char *md5, LwqqErrorCode *err)
 
     switch (status) {
     case 0:
-        if (sava_cookie(lc, req, err)) {
-            goto done;
-        }
+        sava_cookie(lc, req, NULL);
         break;
         
     case 1:
         lwqq_log(LOG_WARNING, "Server busy! Please try again\n");
-        *err = LWQQ_EC_ERROR;
+        err = LWQQ_EC_ERROR;
         goto done;
 
     case 2:
         lwqq_log(LOG_ERROR, "Out of date QQ number\n");
-        *err = LWQQ_EC_ERROR;
+        err = LWQQ_EC_ERROR;
         goto done;
 
     case 3:
         lwqq_log(LOG_ERROR, "Wrong password\n");
-        *err = LWQQ_EC_ERROR;
+        err = LWQQ_EC_ERROR;
         goto done;
 
     case 4:
         lwqq_log(LOG_ERROR, "Wrong verify code\n");
-        *err = LWQQ_EC_ERROR;
+        err = LWQQ_EC_ERROR;
         goto done;
 
     case 5:
         lwqq_log(LOG_ERROR, "Verify failed\n");
-        *err = LWQQ_EC_ERROR;
+        err = LWQQ_EC_ERROR;
         goto done;
 
     case 6:
         lwqq_log(LOG_WARNING, "You may need to try login again\n");
-        *err = LWQQ_EC_ERROR;
+        err = LWQQ_EC_ERROR;
         goto done;
 
     case 7:
         lwqq_log(LOG_ERROR, "Wrong input\n");
-        *err = LWQQ_EC_ERROR;
+        err = LWQQ_EC_ERROR;
         goto done;
 
     case 8:
         lwqq_log(LOG_ERROR, "Too many logins on this IP. Please try again\n");
-        *err = LWQQ_EC_ERROR;
+        err = LWQQ_EC_ERROR;
         goto done;
 
     default:
-        *err = LWQQ_EC_ERROR;
+        err = LWQQ_EC_ERROR;
         lwqq_log(LOG_ERROR, "Unknow error");
         goto done;
     }
 
-    set_online_status(lc, "online", err);
 done:
     lwqq_http_request_free(req);
+    return err;
+}
+/** 
+ * Do really login
+ * 
+ * @param lc 
+ * @param md5 The md5 calculated from calculate_password_md5() 
+ * @param err 
+ */
+static LwqqAsyncEvent* do_login(LwqqClient *lc, const char *md5, LwqqErrorCode *err)
+{
+    char url[1024];
+    LwqqHttpRequest *req;
+    
+    snprintf(url, sizeof(url), "%s/login?u=%s&p=%s&verifycode=%s&"
+             "webqq_type=10&remember_uin=1&aid=1003903&login2qq=1&"
+             "u1=http%%3A%%2F%%2Fweb.qq.com%%2Floginproxy.html"
+             "%%3Flogin2qq%%3D1%%26webqq_type%%3D10&h=1&ptredirect=0&"
+             "ptlang=2052&from_ui=1&pttype=1&dumy=&fp=loginerroralert&"
+             "action=2-11-7438&mibao_css=m_webqq&t=1&g=1", LWQQ_URL_LOGIN_HOST, lc->username, md5, lc->vc->str);
+
+    req = lwqq_http_create_client_request(lc, url, err);
+    if (!req) {
+        return NULL;
+    }
+    /* Setup http header */
+    req->set_cookie_header(req, lwqq_get_cookie_header(lc));
+
+    return req->do_request_async(req, 0, NULL, do_login_back, lc);
 }
 
 /**
@@ -525,27 +460,19 @@ done:
  *        *err will be set LWQQ_EC_ERROR.
  */
 
-static void get_version(LwqqClient *lc, LwqqErrorCode *err)
+static int get_version_back(LwqqHttpRequest* req,void* data)
 {
-    LwqqHttpRequest *req;
+    LwqqClient* lc = data;
     char *response = NULL;
-    int ret;
-
-    req = lwqq_http_create_default_request(LWQQ_URL_VERSION, err);
-    if (!req) {
-        goto done;
-    }
+    int err = LWQQ_EC_OK;
 
-    /* Send request */
-    lwqq_log(LOG_DEBUG, "Get webqq version from %s\n", LWQQ_URL_VERSION);
-    ret = req->do_request(req, 0, NULL);
-    if (ret || req->http_code!=200) {
-        *err = LWQQ_EC_NETWORK_ERROR;
+    if (req->http_code!=200) {
+        err = LWQQ_EC_NETWORK_ERROR;
         goto done;
     }
     response = req->response;
     if(response == NULL){
-        *err = LWQQ_EC_NETWORK_ERROR;
+        err = LWQQ_EC_NETWORK_ERROR;
         goto done;
     }
     if (strstr(response, "ptuiV")) {
@@ -554,7 +481,7 @@ static void get_version(LwqqClient *lc, LwqqErrorCode *err)
         s = strchr(response, '(');
         t = strchr(response, ')');
         if (!s || !t) {
-            *err = LWQQ_EC_ERROR;
+            err = LWQQ_EC_ERROR;
             goto done;
         }
         s++;
@@ -563,11 +490,24 @@ static void get_version(LwqqClient *lc, LwqqErrorCode *err)
         strncpy(v, s, t - s);
         s_free(lc->version);
         lc->version = s_strdup(v);
-        *err = LWQQ_EC_OK;
     }
 
 done:
     lwqq_http_request_free(req);
+    return err;
+}
+static LwqqAsyncEvent* get_version(LwqqClient *lc, LwqqErrorCode *err)
+{
+    LwqqHttpRequest *req;
+
+    req = lwqq_http_create_client_request(lc, LWQQ_URL_VERSION, err);
+    if (!req) {
+        return NULL;
+    }
+
+    /* Send request */
+    lwqq_log(LOG_DEBUG, "Get webqq version from %s\n", LWQQ_URL_VERSION);
+    return req->do_request_async(req, 0, NULL, get_version_back, lc);
 }
 
 static char *generate_clientid()
@@ -593,62 +533,21 @@ static char *generate_clientid()
  * @param err
  * @param lc 
  */
-static void set_online_status(LwqqClient *lc, char *status, LwqqErrorCode *err)
+static int set_online_status_back(LwqqHttpRequest* req,void* data)
 {
-    char msg[1024] ={0};
-    char *buf;
-    LwqqHttpRequest *req = NULL;  
+    LwqqClient* lc = data;
     char *response = NULL;
-    char *cookies;
     int ret;
     json_t *json = NULL;
     char *value;
+    int err = LWQQ_EC_OK;
 
-    if (!status || !err) {
-        goto done ;
-    }
-
-    lc->clientid = generate_clientid();
-    if (!lc->clientid) {
-        lwqq_log(LOG_ERROR, "Generate clientid error\n");
-        *err = LWQQ_EC_ERROR;
-        goto done ;
-    }
-
-    snprintf(msg, sizeof(msg), "{\"status\":\"%s\",\"ptwebqq\":\"%s\","
-             "\"passwd_sig\":""\"\",\"clientid\":\"%s\""
-             ", \"psessionid\":null}"
-             ,status, lc->cookies->ptwebqq
-             ,lc->clientid);
-    buf = url_encode(msg);
-    snprintf(msg, sizeof(msg), "r=%s", buf);
-    s_free(buf);
-
-    /* Create a POST request */
-    req = lwqq_http_create_default_request(LWQQ_URL_SET_STATUS, err);
-    if (!req) {
-        goto done;
-    }
-
-    /* Set header needed by server */
-    req->set_header(req, "Cookie2", "$Version=1");
-    req->set_header(req, "Referer", "http://d.web2.qq.com/proxy.html?v=20101025002");
-    req->set_header(req, "Content-type", "application/x-www-form-urlencoded");
-    
-    /* Set http cookie */
-    cookies = lwqq_get_cookies(lc);
-    if (cookies) {
-        req->set_header(req, "Cookie", cookies);
-        s_free(cookies);
-    }
-    
-    ret = req->do_request(req, 1, msg);
-    if (ret) {
-        *err = LWQQ_EC_NETWORK_ERROR;
+    if (req->http_code == 0) {
+        err = LWQQ_EC_NETWORK_ERROR;
         goto done;
     }
     if (req->http_code != 200) {
-        *err = LWQQ_EC_HTTP_ERROR;
+        err = LWQQ_EC_HTTP_ERROR;
         goto done;
     }
 
@@ -660,12 +559,12 @@ static void set_online_status(LwqqClient *lc, char *status, LwqqErrorCode *err)
     response = req->response;
     ret = json_parse_document(&json, response);
     if (ret != JSON_OK) {
-        *err = LWQQ_EC_ERROR;
+        err = LWQQ_EC_ERROR;
         goto done;
     }
 
     if (!(value = json_parse_simple_value(json, "retcode"))) {
-        *err = LWQQ_EC_ERROR;
+        err = LWQQ_EC_ERROR;
         goto done;
     }
     /**
@@ -702,12 +601,163 @@ static void set_online_status(LwqqClient *lc, char *status, LwqqErrorCode *err)
         lc->psessionid = s_strdup(value);
     }
 
-    *err = LWQQ_EC_OK;
-    
 done:
     if (json)
         json_free_value(&json);
     lwqq_http_request_free(req);
+    return err;
+}
+static LwqqAsyncEvent* set_online_status(LwqqClient *lc, char *status, LwqqErrorCode *err)
+{
+    char msg[1024] ={0};
+    char *buf;
+    LwqqHttpRequest *req = NULL;  
+
+    if (!status || !err) {
+        return NULL;
+    }
+
+    lc->clientid = generate_clientid();
+    if (!lc->clientid) {
+        lwqq_log(LOG_ERROR, "Generate clientid error\n");
+        *err = LWQQ_EC_ERROR;
+        return NULL;
+    }
+
+    snprintf(msg, sizeof(msg), "{\"status\":\"%s\",\"ptwebqq\":\"%s\","
+             "\"passwd_sig\":""\"\",\"clientid\":\"%s\""
+             ", \"psessionid\":null}"
+             ,status, lc->cookies->ptwebqq
+             ,lc->clientid);
+    buf = url_encode(msg);
+    snprintf(msg, sizeof(msg), "r=%s", buf);
+    s_free(buf);
+
+    /* Create a POST request */
+    req = lwqq_http_create_client_request(lc, LWQQ_URL_SET_STATUS, err);
+    if (!req) {
+        return NULL;
+    }
+
+    /* Set header needed by server */
+    req->set_header(req, "Cookie2", "$Version=1");
+    req->set_header(req, "Referer", "http://d.web2.qq.com/proxy.html?v=20101025002");
+    req->set_header(req, "Content-type", "application/x-www-form-urlencoded");
+    
+    /* Set http cookie */
+    req->set_cookie_header(req, lwqq_get_cookie_header(lc));
+    
+    return req->do_request_async(req, 1, msg, set_online_status_back, lc);
+}
+
+typedef enum LoginStage {
+    LOGIN_VERSION,
+    LOGIN_VERIFY_CODE,
+    LOGIN_VERIFY_IMAGE,
+    LOGIN_DO_LOGIN,
+    LOGIN_ONLINE
+} LoginStage;
+/** state of one login in progress */
+typedef struct LoginChain {
+    LwqqClient* lc;
+    LoginStage stage;
+    LwqqAsyncEvent* done;
+} LoginChain;
+
+static LwqqAsyncEvent* login_do_login(LoginChain* chain, LwqqErrorCode *err)
+{
+    LwqqClient* lc = chain->lc;
+    LwqqAsyncEvent* ev;
+
+    /* Third: calculate the md5 */
+    char *md5 = lwqq_enc_pwd(lc->password, lc->vc->str, lc->vc->uin);
+
+    /* Last: do real login */
+    chain->stage = LOGIN_DO_LOGIN;
+    ev = do_login(lc, md5, err);
+    s_free(md5);
+    return ev;
+}
+
+/**
+ * Called when one step finished, it starts the next step or
+ * finishes the whole login with the error code of last step.
+ */
+static void login_step(LwqqAsyncEvent* event,void* data)
+{
+    LoginChain* chain = data;
+    LwqqClient* lc = chain->lc;
+    LwqqErrorCode err = lwqq_async_event_get_result(event);
+    LwqqAsyncEvent* next = NULL;
+
+    switch (chain->stage) {
+    case LOGIN_VERSION:
+        if (err) {
+            lwqq_log(LOG_ERROR, "Get webqq version error\n");
+            break;
+        }
+        lwqq_log(LOG_NOTICE, "Get webqq version: %s\n", lc->version);
+        if (lc->vc) {
+            next = login_do_login(chain, &err);
+        } else {
+            chain->stage = LOGIN_VERIFY_CODE;
+            next = get_verify_code(lc, &err);
+        }
+        break;
+
+    case LOGIN_VERIFY_CODE:
+        switch (err) {
+        case LWQQ_EC_LOGIN_NEED_VC:
+            chain->stage = LOGIN_VERIFY_IMAGE;
+            next = get_verify_image(lc);
+            break;
+
+        case LWQQ_EC_NETWORK_ERROR:
+            lwqq_log(LOG_ERROR, "Network error\n");
+            break;
+
+        case LWQQ_EC_OK:
+            lwqq_log(LOG_DEBUG, "Get verify code OK\n");
+            next = login_do_login(chain, &err);
+            break;
+
+        default:
+            lwqq_log(LOG_ERROR, "Unknown error\n");
+            break;
+        }
+        break;
+
+    case LOGIN_VERIFY_IMAGE:
+        lwqq_log(LOG_WARNING, "Need to enter verify code\n");
+        err = LWQQ_EC_LOGIN_NEED_VC;
+        break;
+
+    case LOGIN_DO_LOGIN:
+        /* Free old value */
+        lwqq_vc_free(lc->vc);
+        lc->vc = NULL;
+        if (err)
+            break;
+        chain->stage = LOGIN_ONLINE;
+        next = set_online_status(lc, "online", &err);
+        break;
+
+    case LOGIN_ONLINE:
+        break;
+    }
+
+    if (next) {
+        lwqq_async_add_event_listener(next, login_step, chain);
+        return ;
+    }
+    if (chain->stage == LOGIN_VERIFY_IMAGE)
+        err = LWQQ_EC_LOGIN_NEED_VC;
+    else if (chain->stage != LOGIN_ONLINE && !err)
+        err = LWQQ_EC_ERROR;
+
+    lwqq_async_event_set_result(chain->done, err);
+    lwqq_async_event_finish(chain->done);
+    s_free(chain);
 }
 
 /** 
@@ -718,66 +768,72 @@ done:
  * 3. Calculate password's md5
  * 4. Do real login 
  * 5. check whether logining successfully
+ *
+ * Every step is sent by async http, the next step is started
+ * in the callback of last one.
+ * 
+ * If server provide us a image and let us enter code shown
+ * in image number, in this situation, the event result is
+ * LWQQ_EC_LOGIN_NEED_VC, so user should call lwqq_login_async() again
+ * after he set correct code to vc->str;
+ * Else, if we can get the code directly, do login immediately.
  * 
  * @param client Lwqq Client 
- * @param err Error code
+ * @return a event finished with error code, NULL if login can't start.
  */
-void lwqq_login(LwqqClient *client, LwqqErrorCode *err)
+LwqqAsyncEvent* lwqq_login_async(LwqqClient *client)
 {
-    if (!client || !err) {
+    LwqqErrorCode err = LWQQ_EC_OK;
+    LoginChain* chain;
+    LwqqAsyncEvent* ev;
+
+    if (!client) {
         lwqq_log(LOG_ERROR, "Invalid pointer\n");
-        return ;
+        return NULL;
     }
 
     /* First: get webqq version */
-    get_version(client, err);
-    if (*err) {
+    ev = get_version(client, &err);
+    if (!ev) {
         lwqq_log(LOG_ERROR, "Get webqq version error\n");
-        return ;
+        return NULL;
     }
-    lwqq_log(LOG_NOTICE, "Get webqq version: %s\n", client->version);
-
-    /**
-     * Second, we get the verify code from server.
-     * If server provide us a image and let us enter code shown
-     * in image number, in this situation, we just return LWQQ_EC_LOGIN_NEED_VC
-     * simply, so user should call lwqq_login() again after he set correct
-     * code to vc->str;
-     * Else, if we can get the code directly, do login immediately.
-     * 
-     */
-    if (!client->vc) {
-        get_verify_code(client, err);
-        switch (*err) {
-        case LWQQ_EC_LOGIN_NEED_VC:
-            get_verify_image(client);
-            lwqq_log(LOG_WARNING, "Need to enter verify code\n");
-            return ;
-        
-        case LWQQ_EC_NETWORK_ERROR:
-            lwqq_log(LOG_ERROR, "Network error\n");
-            return ;
+    chain = s_malloc0(sizeof(*chain));
+    chain->lc = client;
+    chain->stage = LOGIN_VERSION;
+    chain->done = lwqq_async_event_new();
+    lwqq_async_add_event_listener(ev, login_step, chain);
+    return chain->done;
+}
 
-        case LWQQ_EC_OK:
-            lwqq_log(LOG_DEBUG, "Get verify code OK\n");
-            break;
+/** 
+ * WebQQ login function, this waits lwqq_login_async().
+ * it must not be called in main loop thread.
+ * 
+ * @param client Lwqq Client 
+ * @param err Error code
+ */
+void lwqq_login(LwqqClient *client, LwqqErrorCode *err)
+{
+    LwqqAsyncEvent* ev;
+    LwqqAsyncEvset* set;
 
-        default:
-            lwqq_log(LOG_ERROR, "Unknown error\n");
-            return ;
-        }
+    if (!client || !err) {
+        lwqq_log(LOG_ERROR, "Invalid pointer\n");
+        return ;
     }
-    
-    /* Third: calculate the md5 */
-    char *md5 = lwqq_enc_pwd(client->password, client->vc->str, client->vc->uin);
-
-    /* Last: do real login */
-    do_login(client, md5, err);
-    s_free(md5);
 
-    /* Free old value */
-    lwqq_vc_free(client->vc);
-    client->vc = NULL;
+    set = lwqq_async_evset_new();
+    lwqq_async_evset_set_deadline(set, LWQQ_LOGIN_TIMEOUT);
+    ev = lwqq_login_async(client);
+    if (!ev) {
+        //nothing to wait, it frees set
+        lwqq_async_wait(set);
+        *err = LWQQ_EC_ERROR;
+        return ;
+    }
+    lwqq_async_evset_add_event(set, ev);
+    *err = lwqq_async_wait(set);
 }
 
 /** 
@@ -794,7 +850,6 @@ void lwqq_logout(LwqqClient *client, LwqqErrorCode *err)
     json_t *json = NULL;
     char *value;
     struct timeval tv;
-    char *cookies;
     long int re;
 
     if (!client) {
@@ -815,7 +870,7 @@ void lwqq_logout(LwqqClient *client, LwqqErrorCode *err)
              "http://d.web2.qq.com", client->clientid, client->psessionid, re);
 
     /* Create a GET request */
-    req = lwqq_http_create_default_request(url, err);
+    req = lwqq_http_create_client_request(client, url, err);
     if (!req) {
         goto done;
     }
@@ -824,11 +879,7 @@ void lwqq_logout(LwqqClient *client, LwqqErrorCode *err)
     req->set_header(req, "Referer", "http://ptlogin2.qq.com/proxy.html?v=20101025002");
     
     /* Set http cookie */
-    cookies = lwqq_get_cookies(client);
-    if (cookies) {
-        req->set_header(req, "Cookie", cookies);
-        s_free(cookies);
-    }
+    req->set_cookie_header(req, lwqq_get_cookie_header(client));
     
     ret = req->do_request(req, 0, NULL);
     if (ret) {
@@ -880,7 +931,7 @@ done:
     char post[1024];
     int ret;
     snprintf(url,sizeof(url),"%s/channel/login2","http://d.web2.qq.com");
-    LwqqHttpRequest* req = lwqq_http_create_default_request(url,NULL);
+    LwqqHttpRequest* req = lwqq_http_create_client_request(client,url,NULL);
     if(req==NULL){
         goto done;
     }
@@ -17,6 +17,16 @@
  * WebQQ login function
  * 
  * @param client Lwqq Client 
+ * @return a event finished with login error code.
+ *         NULL if login can't start.
+ */
+LwqqAsyncEvent* lwqq_login_async(LwqqClient *client);
+
+/** 
+ * WebQQ login function, this is a wait on lwqq_login_async().
+ * do not call it in main loop thread.
+ * 
+ * @param client Lwqq Client 
  * @param err Error code
  */
 void lwqq_login(LwqqClient *client, LwqqErrorCode *err);
@@ -10,6 +10,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <curl/curl.h>
 
 #include "type.h"
@@ -24,6 +28,19 @@
 #include "async.h"
 #include "info.h"
 
+/** server retcode of sending too fast */
+#define LWQQ_SEND_TOO_FAST 108
+/** default send rate (msg/s) and burst of a client */
+#define LWQQ_SEND_RATE 1.0
+#define LWQQ_SEND_BURST 5
+/** rate never goes below this after 108, and grows this per success */
+#define LWQQ_SEND_MIN_RATE 0.1
+#define LWQQ_SEND_RATE_STEP 0.1
+/** resend a message at most this times on 108 */
+#define LWQQ_SEND_MAX_RETRY 5
+/** threads waiting pictures or a sync send give up after this ms */
+#define LWQQ_MSG_WAIT_TIMEOUT 60000
+
 static void *start_poll_msg(void *msg_list);
 static void lwqq_recvmsg_poll_msg(struct LwqqRecvMsgList *list);
 static json_t *get_result_json_object(json_t *json);
@@ -146,10 +163,12 @@ static void lwqq_msg_message_free(void *opaque)
                 s_free(c->data.img.file_path);
                 s_free(c->data.img.name);
                 s_free(c->data.img.data);
+                s_free(c->data.img.path);
                 break;
             case LWQQ_CONTENT_CFACE:
                 s_free(c->data.cface.data);
                 s_free(c->data.cface.name);
+                s_free(c->data.cface.path);
                 s_free(c->data.cface.file_id);
                 s_free(c->data.cface.key);
                 break;
@@ -616,13 +635,27 @@ const char* get_host_of_url(const char* url,char* buffer)
         strncpy(buffer,ptr,end-ptr);
     return buffer;
 }
-static void request_content_offpic(LwqqClient* lc,const char* f_uin,LwqqMsgContent* c)
+static int request_content_offpic_back(LwqqHttpRequest* req,void* data)
+{
+    LwqqMsgContent* c = data;
+    int err = 0;
+    if(req->http_code!=200){
+        err = LWQQ_EC_HTTP_ERROR;
+        goto done;
+    }
+
+    c->data.img.data = req->response;
+    c->data.img.size = req->resp_len;
+    req->response = NULL;
+done:
+    lwqq_http_request_free(req);
+    return err;
+}
+static LwqqAsyncEvent* request_content_offpic(LwqqClient* lc,const char* f_uin,LwqqMsgContent* c)
 {
     LwqqHttpRequest* req;
     LwqqErrorCode error;
     LwqqErrorCode *err = &error;
-    char* cookies;
-    int ret;
     char url[512];
     char *file_path = url_encode(c->data.img.file_path);
     //there are face 1 to face 10 server to accelerate speed.
@@ -631,42 +664,38 @@ static void request_content_offpic(LwqqClient* lc,const char* f_uin,LwqqMsgConte
              "http://d.web2.qq.com/channel",
              file_path,f_uin,lc->clientid,lc->psessionid);
     s_free(file_path);
-    req = lwqq_http_create_default_request(url, err);
+    req = lwqq_http_create_client_request(lc, url, err);
     if (!req) {
-        goto done;
+        return NULL;
     }
     req->set_header(req, "Referer", "http://web2.qq.com/");
     req->set_header(req,"Host","d.web2.qq.com");
 
-    cookies = lwqq_get_cookies(lc);
-    if (cookies) {
-        req->set_header(req, "Cookie", cookies);
-        s_free(cookies);
-    }
-    ret = req->do_request(req, 0, NULL);
-
-    if(ret||(req->http_code!=200)){
-        if(err){
-            *err = LWQQ_EC_HTTP_ERROR;
-            goto done;
-        }
+    req->set_cookie_header(req, lwqq_get_cookie_header(lc));
+    return req->do_request_async(req,0,NULL,request_content_offpic_back,c);
+}
+static int request_content_cface_back(LwqqHttpRequest* req,void* data)
+{
+    LwqqMsgContent* c = data;
+    int err = 0;
+    //cface2 may answer a redirect with picture as body
+    if(req->http_code!=200&&req->http_code!=302){
+        err = LWQQ_EC_HTTP_ERROR;
+        goto done;
     }
 
-    c->data.img.data = req->response;
-    c->data.img.size = req->resp_len;
+    c->data.cface.data = req->response;
+    c->data.cface.size = req->resp_len;
     req->response = NULL;
-    
 done:
     lwqq_http_request_free(req);
-    return;
+    return err;
 }
-static void request_content_cface(LwqqClient* lc,const char* group_code,const char* send_uin,LwqqMsgContent* c)
+static LwqqAsyncEvent* request_content_cface(LwqqClient* lc,const char* group_code,const char* send_uin,LwqqMsgContent* c)
 {
     LwqqHttpRequest* req;
     LwqqErrorCode error;
     LwqqErrorCode *err = &error;
-    char* cookies;
-    int ret;
     char url[512];
 /*http://web2.qq.com/cgi-bin/get_group_pic?type=0&gid=3971957129&uin=4174682545&rip=120.196.211.216&rport=9072&fid=2857831080&pic=71A8E53B7F678D035656FECDA1BD7F31.jpg&vfwebqq=762a8682d17931d0cc647515e570435bd82e3a4e957bd052faa9615192eb7a3c4f1719006a7176c1&t=1343130567*/
     snprintf(url, sizeof(url),
@@ -674,88 +703,66 @@ static void request_content_cface(LwqqClient* lc,const char* group_code,const ch
              "http://web2.qq.com/cgi-bin",
              group_code,send_uin,c->data.cface.serv_ip,c->data.cface.serv_port,
              c->data.cface.file_id,c->data.cface.name,lc->vfwebqq,time(NULL));
-    req = lwqq_http_create_default_request(url, err);
+    req = lwqq_http_create_client_request(lc, url, err);
     if (!req) {
-        goto done;
+        return NULL;
     }
     req->set_header(req, "Referer", "http://web2.qq.com/");
     ///this is very important!!!!!!!!!
     req->set_header(req, "Host", "web2.qq.com");
-    cookies = lwqq_get_cookies(lc);
-    if (cookies) {
-        req->set_header(req, "Cookie", cookies);
-        s_free(cookies);
-    }
+    req->set_cookie_header(req, lwqq_get_cookie_header(lc));
 
-    ret = req->do_request(req,0,NULL);
-
-    if(ret||req->http_code!=200){
-        if(err){
-            *err = LWQQ_EC_HTTP_ERROR;
-            goto done;
-        }
-    }
-
-    c->data.cface.data = req->response;
-    c->data.cface.size = req->resp_len;
-    req->response = NULL;
-done:
-    lwqq_http_request_free(req);
+    return req->do_request_async(req,0,NULL,request_content_cface_back,c);
 }
-static void request_content_cface2(LwqqClient* lc,const char* msg_id,const char* from_uin,LwqqMsgContent* c)
+static LwqqAsyncEvent* request_content_cface2(LwqqClient* lc,const char* msg_id,const char* from_uin,LwqqMsgContent* c)
 {
     LwqqHttpRequest* req;
     LwqqErrorCode error;
     LwqqErrorCode *err = &error;
-    char* cookies;
-    int ret;
     char url[512];
 /*http://d.web2.qq.com/channel/get_cface2?lcid=3588&guid=85930B6CCE38BDAEF176FA83F0491569.jpg&to=2217604723&count=5&time=1&clientid=6325200&psessionid=8368046764001d636f6e6e7365727665725f77656271714031302e3133342e362e31333800001c9b000000d8026e04009563e4146d0000000a403946423664616232666d00000028ceb438eb76f1bc88360fc303e9148cc5dac8652a7a4bb702ee6dcf9bb10adf571a48b8a76b599e44*/
     snprintf(url, sizeof(url),
              "%s/get_cface2?lcid=%s&to=%s&guid=%s&count=5&time=1&clientid=%s&psessionid=%s",
              "http://d.web2.qq.com/channel",
              msg_id,from_uin,c->data.cface.name,lc->clientid,lc->psessionid);
-    req = lwqq_http_create_default_request(url, err);
+    req = lwqq_http_create_client_request(lc, url, err);
     if (!req) {
-        goto done;
+        return NULL;
     }
     curl_easy_setopt(req->req,CURLOPT_VERBOSE,1);
     req->set_header(req, "Referer", "http://web2.qq.com/");
     ///this is very important!!!!!!!!!
     //req->set_header(req, "Host", "d.web2.qq.com");
-    cookies = lwqq_get_cookies(lc);
-    if (cookies) {
-        req->set_header(req, "Cookie", cookies);
-        s_free(cookies);
-    }
-
-    ret = req->do_request(req,0,NULL);
-
-    if(ret||(req->http_code!=302&&req->http_code!=200)){
-        goto done;
-    }
-
+    req->set_cookie_header(req, lwqq_get_cookie_header(lc));
 
-    c->data.cface.data = req->response;
-    c->data.cface.size = req->resp_len;
-    req->response = NULL;
-
-done:
-    lwqq_http_request_free(req);
+    return req->do_request_async(req,0,NULL,request_content_cface_back,c);
 }
+/**
+ * fetch all pictures of a message at once and wait them.
+ * this is called in poll thread.
+ */
 static void request_msg_offpic(LwqqClient* lc,int type,LwqqMsgMessage* msg)
 {
     LwqqMsgContent* c;
+    LwqqAsyncEvent* ev;
+    LwqqAsyncEvset* set = lwqq_async_evset_new();
+    //before requests are issued, so transfers get it as timeout
+    lwqq_async_evset_set_deadline(set,LWQQ_MSG_WAIT_TIMEOUT);
     TAILQ_FOREACH(c,&msg->content,entries){
+        ev = NULL;
         if(c->type == LWQQ_CONTENT_OFFPIC){
-            request_content_offpic(lc,msg->from,c);
+            ev = request_content_offpic(lc,msg->from,c);
         }else if(c->type == LWQQ_CONTENT_CFACE){
             if(type == LWQQ_MT_BUDDY_MSG)
-                request_content_cface2(lc,msg->msg_id,msg->from,c);
+                ev = request_content_cface2(lc,msg->msg_id,msg->from,c);
             else
-                request_content_cface(lc,msg->group_code,msg->send,c);
+                ev = request_content_cface(lc,msg->group_code,msg->send,c);
         }
+        if(ev == NULL) continue;
+        lwqq_async_evset_add_event(set,ev);
     }
+    if(lwqq_async_wait(set)==LWQQ_EC_TIMEOUT)
+        lwqq_log(LOG_WARNING,"pictures of message %s timed out\n",msg->msg_id);
 }
 /**
  * Parse message received from server
@@ -864,7 +871,6 @@ static void *start_poll_msg(void *msg_list)
     LwqqClient *lc;
     LwqqHttpRequest *req = NULL;  
     int ret;
-    char *cookies;
     char *s;
     int retcode;
     char msg[1024];
@@ -884,18 +890,13 @@ static void *start_poll_msg(void *msg_list)
     /* Create a POST request */
     char url[512];
     snprintf(url, sizeof(url), "%s/channel/poll2", "http://d.web2.qq.com");
-    req = lwqq_http_create_default_request(url, NULL);
+    req = lwqq_http_create_client_request(lc, url, NULL);
     if (!req) {
         goto failed;
     }
-    req->set_header(req, "Referer", "http://d.web2.qq.com/proxy.html?v=20101025002");
-    req->set_header(req, "Content-Transfer-Encoding", "binary");
-    req->set_header(req, "Content-type", "application/x-www-form-urlencoded");
-    cookies = lwqq_get_cookies(lc);
-    if (cookies) {
-        req->set_header(req, "Cookie", cookies);
-        s_free(cookies);
-    }
+    req->set_header_template(req,LWQQ_HTTP_HEADER_POLL);
+    req->set_cookie_header(req, lwqq_get_cookie_header(lc));
+    req->priority = LWQQ_HTTP_PRIO_POLL;
     while(1) {
         ret = req->do_request(req, 1, msg);
         printf("%ld\n",req->http_code);
@@ -1001,10 +1002,37 @@ static char* content_parse_string(LwqqMsgMessage* msg,int msg_type,int *has_cfac
     return buf;
 }
 
+/**
+ * add picture from memory, or stream it from local file.
+ * @return 0 on success
+ */
+static int add_picture(LwqqHttpRequest* req,const char* name,const char* filename,
+        const char* data,size_t size,const char* path)
+{
+    struct stat st;
+    int fd;
+    if(data){
+        req->add_file_content(req,name,filename,data,size,NULL);
+        return 0;
+    }
+    fd = open(path,O_RDONLY);
+    if(fd < 0 || fstat(fd,&st) < 0 || st.st_size == 0){
+        lwqq_log(LOG_ERROR,"Open picture %s failed\n",path);
+        if(fd >= 0) close(fd);
+        return -1;
+    }
+    return req->add_file_fd(req,name,filename,fd,st.st_size,NULL);
+}
+static void upload_progress(void* data,size_t now,size_t total)
+{
+    lwqq_log(LOG_DEBUG,"Upload %s %lu/%lu\n",(const char*)data,
+            (unsigned long)now,(unsigned long)total);
+}
 LwqqAsyncEvent* lwqq_msg_upload_offline_pic(LwqqClient* lc,const char* to,LwqqMsgContent* c)
 {
     if(c->type != LWQQ_CONTENT_OFFPIC) return NULL;
-    if(!c->data.img.data || !c->data.img.name || !c->data.img.size) return NULL;
+    if(!c->data.img.name) return NULL;
+    if(!(c->data.img.data && c->data.img.size) && !c->data.img.path) return NULL;
 
     LwqqHttpRequest *req;
     LwqqErrorCode err;
@@ -1013,18 +1041,12 @@ LwqqAsyncEvent* lwqq_msg_upload_offline_pic(LwqqClient* lc,const char* to,LwqqMs
     c->data.img.data = NULL;
     size_t size = c->data.img.size;
     char url[512];
-    char *cookies;
 
     snprintf(url,sizeof(url),"http://weboffline.ftn.qq.com/ftn_access/upload_offline_pic?time=%ld",
             time(NULL));
-    req = lwqq_http_create_default_request(url,&err);
-    req->set_header(req,"Origin","http://web2.qq.com");
-    req->set_header(req,"Referer","http://web2.qq.com/");
-    cookies = lwqq_get_cookies(lc);
-    if (cookies) {
-        req->set_header(req, "Cookie", cookies);
-        s_free(cookies);
-    }
+    req = lwqq_http_create_client_request(lc,url,&err);
+    req->set_header_template(req,LWQQ_HTTP_HEADER_UPLOAD);
+    req->set_cookie_header(req, lwqq_get_cookie_header(lc));
     req->add_form(req,LWQQ_FORM_CONTENT,"callback","parent.EQQ.Model.ChatMsg.callbackSendPic");
     req->add_form(req,LWQQ_FORM_CONTENT,"locallangid","2052");
     req->add_form(req,LWQQ_FORM_CONTENT,"clientversion","1409");
@@ -1032,12 +1054,18 @@ LwqqAsyncEvent* lwqq_msg_upload_offline_pic(LwqqClient* lc,const char* to,LwqqMs
     req->add_form(req,LWQQ_FORM_CONTENT,"skey",lc->cookies->skey);
     req->add_form(req,LWQQ_FORM_CONTENT,"appid","1002101");
     req->add_form(req,LWQQ_FORM_CONTENT,"peeruin","593023668");///<what this means?
-    req->add_file_content(req,"file",filename,buffer,size,NULL);
+    if(add_picture(req,"file",filename,buffer,size,c->data.img.path)){
+        lwqq_http_request_free(req);
+        return NULL;
+    }
     req->add_form(req,LWQQ_FORM_CONTENT,"fileid","1");
     req->add_form(req,LWQQ_FORM_CONTENT,"vfwebqq",lc->vfwebqq);
     req->add_form(req,LWQQ_FORM_CONTENT,"senderviplevel","0");
     req->add_form(req,LWQQ_FORM_CONTENT,"reciverviplevel","0");
 
+    req->set_progress(req,upload_progress,c->data.img.name);
+
+    req->priority = LWQQ_HTTP_PRIO_SEND;
     return req->do_request_async(req,0,NULL,upload_offline_pic_back,c);
 }
 static int upload_offline_pic_back(LwqqHttpRequest* req,void* data)
@@ -1066,50 +1094,59 @@ done:
     lwqq_http_request_free(req);
     return 0;
 }
-static int query_gface_sig(LwqqClient* lc)
+static int query_gface_sig_back(LwqqHttpRequest* req,void* data)
+{
+    LwqqClient* lc = data;
+    json_t* json = NULL;
+    int err = 0;
+    if(req->http_code !=200){
+        err = LWQQ_EC_HTTP_ERROR;
+        goto done;
+    }
+    json_parse_document(&json,req->response);
+    //several uploads may query it at same time
+    if(!lc->gface_sig){
+        lc->gface_key = s_strdup(json_parse_simple_value(json,"gface_key"));
+        lc->gface_sig = s_strdup(json_parse_simple_value(json,"gface_sig"));
+    }
+
+done:
+    if(json)
+        json_free_value(&json);
+    lwqq_http_request_free(req);
+    return err;
+}
+static LwqqAsyncEvent* query_gface_sig(LwqqClient* lc)
 {
     LwqqHttpRequest *req;
     LwqqErrorCode err;
     char url[512];
-    char *cookies;
-    int ret;
-    int succ = 0;
-    if(lc->gface_key&&lc->gface_sig){
-        return 1;
-    }
 
     //https://d.web2.qq.com/channel/get_gface_sig2?clientid=30179476&psessionid=8368046764001e636f6e6e7365727665725f77656271714031302e3132382e36362e31313500006158000000c4036e04005c821a956d0000000a4065466637416b7142666d00000028fdd28eddedb8dd0cd414fdcb13af93532615ebe10b93f55182189da5c557360fee73da41ebf0c9fc&t=1343198241175
     snprintf(url,sizeof(url),"%s/get_gface_sig2?clientid=%s&psessionid=%s&t=%ld",
             "https://d.web2.qq.com/channel",lc->clientid,lc->psessionid,time(NULL));
-    req = lwqq_http_create_default_request(url,&err);
+    req = lwqq_http_create_client_request(lc,url,&err);
+    if(!req)
+        return NULL;
     req->set_header(req,"Host","d.web2.qq.com");
     req->set_header(req,"Referer","https://d.web2.qq.com/cfproxy.html?v=20110331002&callback=1");
-    cookies = lwqq_get_cookies(lc);
-    if (cookies) {
-        req->set_header(req, "Cookie", cookies);
-        s_free(cookies);
-    }
+    req->set_cookie_header(req, lwqq_get_cookie_header(lc));
 
-    ret = req->do_request(req,0,NULL);
-    if(ret||req->http_code !=200){
-        goto done;
-    }
-    json_t* json = NULL;
-    json_parse_document(&json,req->response);
-    lc->gface_key = s_strdup(json_parse_simple_value(json,"gface_key"));
-    lc->gface_sig = s_strdup(json_parse_simple_value(json,"gface_sig"));
-    succ = 1;
-    
-done:
-    if(json)
-        json_free_value(&json);
-    lwqq_http_request_free(req);
-    return succ;
+    req->priority = LWQQ_HTTP_PRIO_SEND;
+    return req->do_request_async(req,0,NULL,query_gface_sig_back,lc);
+}
+/** finish upload event after both upload and gface sig query done */
+static void upload_cface_done(int result,void* data)
+{
+    LwqqAsyncEvent* ev = data;
+    lwqq_async_event_set_result(ev,result);
+    lwqq_async_event_finish(ev);
 }
 LwqqAsyncEvent* lwqq_msg_upload_cface(LwqqClient* lc,LwqqMsgType type,LwqqMsgContent* c)
 {
     if(c->type != LWQQ_CONTENT_CFACE) return NULL;
-    if(!c->data.cface.name || !c->data.cface.data || !c->data.cface.size) return NULL;
+    if(!c->data.cface.name) return NULL;
+    if(!(c->data.cface.data && c->data.cface.size) && !c->data.cface.path) return NULL;
     const char *filename = c->data.cface.name;
     const char *buffer = c->data.cface.data;
     c->data.cface.data = NULL;
@@ -1117,22 +1154,16 @@ LwqqAsyncEvent* lwqq_msg_upload_cface(LwqqClient* lc,LwqqMsgType type,LwqqMsgCon
     LwqqHttpRequest *req;
     LwqqErrorCode err;
     char url[512];
-    char *cookies;
     static int fileid = 1;
     char fileid_str[20];
 
     snprintf(url,sizeof(url),"http://up.web2.qq.com/cgi-bin/cface_upload?time=%ld",
             time(NULL));
-    req = lwqq_http_create_default_request(url,&err);
+    req = lwqq_http_create_client_request(lc,url,&err);
     curl_easy_setopt(req->req,CURLOPT_VERBOSE,1);
-    req->set_header(req,"Origin","http://web2.qq.com");
-    req->set_header(req,"Referer","http://web2.qq.com/");
+    req->set_header_template(req,LWQQ_HTTP_HEADER_UPLOAD);
     //req->set_header(req,"Host","up.web2.qq.com");
-    cookies = lwqq_get_cookies(lc);
-    if (cookies) {
-        req->set_header(req, "Cookie", cookies);
-        s_free(cookies);
-    }
+    req->set_cookie_header(req, lwqq_get_cookie_header(lc));
     req->add_form(req,LWQQ_FORM_CONTENT,"vfwebqq",lc->vfwebqq);
     //this is special for group msg.it can upload over 250K
     req->add_form(req,LWQQ_FORM_CONTENT,"from","control");
@@ -1141,22 +1172,32 @@ LwqqAsyncEvent* lwqq_msg_upload_cface(LwqqClient* lc,LwqqMsgType type,LwqqMsgCon
     } else if(type == LWQQ_MT_BUDDY_MSG){
         req->add_form(req,LWQQ_FORM_CONTENT,"f","EQQ.Model.ChatMsg.callbackSendPic");
     }
-    req->add_file_content(req,"custom_face",filename,buffer,size,NULL);
+    if(add_picture(req,"custom_face",filename,buffer,size,c->data.cface.path)){
+        lwqq_http_request_free(req);
+        return NULL;
+    }
+    req->set_progress(req,upload_progress,c->data.cface.name);
     snprintf(fileid_str,sizeof(fileid_str),"%d",fileid++);
     //cface 上传是会占用自定义表情的空间的.这里的fileid是几就是占用第几个格子.
     req->add_form(req,LWQQ_FORM_CONTENT,"fileid","1");
 
-    void **data = s_malloc0(sizeof(void*)*2);
-    data[0] = lc;
-    data[1] = c;
-    return req->do_request_async(req,0,NULL,upload_cface_back,data);
+    req->priority = LWQQ_HTTP_PRIO_SEND;
+    LwqqAsyncEvent* ev = req->do_request_async(req,0,NULL,upload_cface_back,c);
+    LwqqAsyncEvent* sig;
+    //group message needs gface sig. query it along with upload
+    if(ev && !lc->gface_sig && (sig = query_gface_sig(lc))){
+        LwqqAsyncEvent* ret = lwqq_async_event_new();
+        LwqqAsyncEvset* set = lwqq_async_evset_new_callback();
+        lwqq_async_evset_add_event(set,ev);
+        lwqq_async_evset_add_event(set,sig);
+        lwqq_async_add_evset_listener(set,upload_cface_done,ret);
+        return ret;
+    }
+    return ev;
 }
 static int upload_cface_back(LwqqHttpRequest *req,void* data)
 {
-    void **d = data;
-    LwqqClient* lc = d[0];
-    LwqqMsgContent *c = d[1];
-    s_free(data);
+    LwqqMsgContent *c = data;
     int ret;
     int errno = 0;
     char msg[256];
@@ -1193,29 +1234,14 @@ static int upload_cface_back(LwqqHttpRequest *req,void* data)
     s_free(c->data.cface.name);
     c->data.cface.name = s_strdup(file);
     c->data.cface.data = NULL;
-
-    static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-    pthread_mutex_lock(&mutex);
-    if(!lc->gface_sig)
-        query_gface_sig(lc);
-    pthread_mutex_unlock(&mutex);
 done:
     lwqq_http_request_free(req);
     return errno;
 }
-/** 
- * 
- * 
- * @param lc 
- * @param sendmsg 
- * 
- * @return 1 means ok
- *         0 means failed or send failed
- */
-LwqqAsyncEvent* lwqq_msg_send(LwqqClient *lc, LwqqMsg *msg)
+/** post a message now, it bypasses send limiter */
+static LwqqAsyncEvent* msg_send_request(LwqqClient *lc, LwqqMsg *msg)
 {
     LwqqHttpRequest *req = NULL;  
-    char *cookies;
     char *content = NULL;
     char data[1024] = {0};
     LwqqMsgMessage *mmsg;
@@ -1259,19 +1285,14 @@ LwqqAsyncEvent* lwqq_msg_send(LwqqClient *lc, LwqqMsg *msg)
     /* Create a POST request */
     char url[512];
     snprintf(url, sizeof(url), "%s/channel/%s", "http://d.web2.qq.com",apistr);
-    req = lwqq_http_create_default_request(url, NULL);
+    req = lwqq_http_create_client_request(lc, url, NULL);
     if (!req) {
         goto failed;
     }
-    req->set_header(req, "Referer", "http://d.web2.qq.com/proxy.html?v=20101025002");
-    req->set_header(req, "Content-Transfer-Encoding", "binary");
-    req->set_header(req, "Content-type", "application/x-www-form-urlencoded");
-    cookies = lwqq_get_cookies(lc);
-    if (cookies) {
-        req->set_header(req, "Cookie", cookies);
-        s_free(cookies);
-    }
+    req->set_header_template(req,LWQQ_HTTP_HEADER_SEND);
+    req->set_cookie_header(req, lwqq_get_cookie_header(lc));
     
+    req->priority = LWQQ_HTTP_PRIO_SEND;
     return req->do_request_async(req, 1, data,msg_send_back,lc);
 
 failed:
@@ -1305,6 +1326,247 @@ failed:
     return errno;
 }
 
+/** one message waiting in send queue */
+typedef struct SendItem {
+    LwqqSendLimiter* limiter;
+    LwqqMsg* msg;
+    LwqqAsyncEvent* event;///< returned to caller, finished with final result
+    LwqqAsyncEvent* wire;///< send request while inflight
+    int retry;
+    int cancelled;///< result given by cancel
+    TAILQ_ENTRY(SendItem) entries;
+} SendItem;
+/**
+ * token bucket in front of send api, one token per message.
+ * only one message is on the wire so a resend never overtakes the next
+ * message. rate is halved on retcode 108 and slowly recovers on success.
+ */
+struct LwqqSendLimiter {
+    LwqqClient* lc;
+    pthread_mutex_t lock;
+    TAILQ_HEAD(,SendItem) queue;
+    double tokens;
+    double rate;///< tokens per second
+    double max_rate;
+    double burst;
+    double last;///< seconds, last refill
+    int timer;
+    SendItem* inflight;
+    int closed;///< client freed while a message is on the wire
+};
+
+static double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+static void limiter_refill(LwqqSendLimiter* l)
+{
+    double now = now_seconds();
+    l->tokens += (now - l->last) * l->rate;
+    if(l->tokens > l->burst) l->tokens = l->burst;
+    l->last = now;
+}
+static int limiter_pump(void* data);
+static void limiter_sent(LwqqAsyncEvent* ev,void* data);
+/** caller holds lock */
+static void limiter_schedule(LwqqSendLimiter* l,int ms)
+{
+    if(l->timer == 0)
+        l->timer = lwqq_async_timer_add(ms,limiter_pump,l);
+}
+static void send_item_finish(SendItem* item,int result)
+{
+    lwqq_async_event_set_result(item->event,result);
+    lwqq_async_event_finish(item->event);
+    s_free(item);
+}
+/** send queue head when a token is ready. run in main loop */
+static int limiter_pump(void* data)
+{
+    LwqqSendLimiter* l = data;
+    SendItem* item = NULL;
+    pthread_mutex_lock(&l->lock);
+    l->timer = 0;
+    if(l->inflight == NULL && !TAILQ_EMPTY(&l->queue)){
+        limiter_refill(l);
+        if(l->tokens >= 1.0){
+            l->tokens -= 1.0;
+            item = TAILQ_FIRST(&l->queue);
+            TAILQ_REMOVE(&l->queue,item,entries);
+            l->inflight = item;
+        }else
+            limiter_schedule(l,(1.0 - l->tokens) / l->rate * 1000 + 1);
+    }
+    pthread_mutex_unlock(&l->lock);
+
+    if(item){
+        LwqqAsyncEvent* ev = msg_send_request(l->lc,item->msg);
+        if(ev){
+            int cancelled;
+            lwqq_async_add_event_listener(ev,limiter_sent,item);
+            pthread_mutex_lock(&l->lock);
+            item->wire = ev;
+            cancelled = item->cancelled;
+            pthread_mutex_unlock(&l->lock);
+            //cancel came while request was built
+            if(cancelled) lwqq_async_event_cancel(ev);
+        }else{
+            pthread_mutex_lock(&l->lock);
+            l->inflight = NULL;
+            if(!TAILQ_EMPTY(&l->queue)) limiter_schedule(l,0);
+            pthread_mutex_unlock(&l->lock);
+            send_item_finish(item,LWQQ_EC_ERROR);
+        }
+    }
+    return 0;
+}
+static void limiter_sent(LwqqAsyncEvent* ev,void* data)
+{
+    SendItem* item = data;
+    LwqqSendLimiter* l = item->limiter;
+    int result = lwqq_async_event_get_result(ev);
+
+    pthread_mutex_lock(&l->lock);
+    l->inflight = NULL;
+    item->wire = NULL;
+    if(item->cancelled) result = item->cancelled;
+    if(l->closed){
+        pthread_mutex_unlock(&l->lock);
+        pthread_mutex_destroy(&l->lock);
+        s_free(l);
+        send_item_finish(item,LWQQ_EC_CANCELED);
+        return;
+    }
+    if(result == LWQQ_SEND_TOO_FAST && item->retry < LWQQ_SEND_MAX_RETRY &&
+            !item->cancelled){
+        //server wants us slower, put it back in front of the queue
+        item->retry++;
+        l->rate /= 2;
+        if(l->rate < LWQQ_SEND_MIN_RATE) l->rate = LWQQ_SEND_MIN_RATE;
+        l->tokens = 0;
+        lwqq_log(LOG_WARNING,"Sending too fast, slow down to %.2f msg/s\n",l->rate);
+        TAILQ_INSERT_HEAD(&l->queue,item,entries);
+        limiter_schedule(l,1000 / l->rate);
+        pthread_mutex_unlock(&l->lock);
+        return;
+    }
+    if(result == 0){
+        l->rate += LWQQ_SEND_RATE_STEP;
+        if(l->rate > l->max_rate) l->rate = l->max_rate;
+    }
+    if(!TAILQ_EMPTY(&l->queue)) limiter_schedule(l,0);
+    pthread_mutex_unlock(&l->lock);
+    send_item_finish(item,result);
+}
+
+/** drop a queued message, or cancel its request on the wire. run in main loop */
+static void send_item_cancel(void* data,int result)
+{
+    SendItem* item = data;
+    LwqqSendLimiter* l = item->limiter;
+    LwqqAsyncEvent* wire;
+    pthread_mutex_lock(&l->lock);
+    if(item->cancelled){
+        pthread_mutex_unlock(&l->lock);
+        return;
+    }
+    item->cancelled = result;
+    if(l->inflight != item){
+        TAILQ_REMOVE(&l->queue,item,entries);
+        pthread_mutex_unlock(&l->lock);
+        send_item_finish(item,result);
+        return;
+    }
+    //taken under lock, limiter_sent clears it before item is finished.
+    //NULL while limiter_pump builds the request, it cancels it then
+    wire = item->wire;
+    pthread_mutex_unlock(&l->lock);
+    //limiter_sent finishes item
+    if(wire && lwqq_async_event_cancel(wire) != 0)
+        lwqq_log(LOG_WARNING,"Message on the wire can not be cancelled\n");
+}
+LwqqSendLimiter* lwqq_send_limiter_new(LwqqClient* lc)
+{
+    LwqqSendLimiter* l = s_malloc0(sizeof(*l));
+    l->lc = lc;
+    pthread_mutex_init(&l->lock,NULL);
+    TAILQ_INIT(&l->queue);
+    l->max_rate = l->rate = LWQQ_SEND_RATE;
+    l->tokens = l->burst = LWQQ_SEND_BURST;
+    l->last = now_seconds();
+    return l;
+}
+void lwqq_send_limiter_free(LwqqSendLimiter* l)
+{
+    SendItem* item;
+    int inflight;
+    TAILQ_HEAD(,SendItem) dropped = TAILQ_HEAD_INITIALIZER(dropped);
+    if(!l) return;
+    pthread_mutex_lock(&l->lock);
+    lwqq_async_timer_remove(l->timer);
+    l->timer = 0;
+    TAILQ_CONCAT(&dropped,&l->queue,entries);
+    inflight = (l->inflight != NULL);
+    //limiter_sent free it later
+    if(inflight) l->closed = 1;
+    pthread_mutex_unlock(&l->lock);
+
+    //listeners may call send api, never call them with lock held
+    while((item = TAILQ_FIRST(&dropped))){
+        TAILQ_REMOVE(&dropped,item,entries);
+        send_item_finish(item,LWQQ_EC_CANCELED);
+    }
+    if(!inflight){
+        pthread_mutex_destroy(&l->lock);
+        s_free(l);
+    }
+}
+void lwqq_msg_set_send_rate(LwqqClient* lc,double rate,int burst)
+{
+    if(!lc || !lc->send_limiter)
+        return;
+    LwqqSendLimiter* l = lc->send_limiter;
+    pthread_mutex_lock(&l->lock);
+    if(rate > 0) l->max_rate = l->rate = rate;
+    if(burst > 0) l->burst = burst;
+    pthread_mutex_unlock(&l->lock);
+}
+/** 
+ * queue a message, it is sent when send limiter allows.
+ * without a limiter it is sent right away.
+ * 
+ * @param lc 
+ * @param sendmsg 
+ * 
+ * @return a event finished after message is sent,
+ *         result is 0 or retcode of server
+ */
+LwqqAsyncEvent* lwqq_msg_send(LwqqClient *lc, LwqqMsg *msg)
+{
+    if(!lc || !msg || (msg->type != LWQQ_MT_BUDDY_MSG &&
+                msg->type != LWQQ_MT_GROUP_MSG))
+        return NULL;
+    LwqqSendLimiter* l = lc->send_limiter;
+    //client not made by lwqq_client_new, or limiter already freed
+    if(l == NULL)
+        return msg_send_request(lc,msg);
+    SendItem* item = s_malloc0(sizeof(*item));
+    item->limiter = l;
+    item->msg = msg;
+    item->event = lwqq_async_event_new();
+    LwqqAsyncEvent* ev = item->event;
+    lwqq_async_event_set_cancel(ev,send_item_cancel,item);
+
+    pthread_mutex_lock(&l->lock);
+    TAILQ_INSERT_TAIL(&l->queue,item,entries);
+    //pump in main loop, caller may be a upload thread
+    limiter_schedule(l,0);
+    pthread_mutex_unlock(&l->lock);
+    return ev;
+}
+
 int lwqq_msg_send_simple(LwqqClient* lc,int type,const char* to,const char* message)
 {
     if(!lc||!to||!message)
@@ -1322,7 +1584,7 @@ int lwqq_msg_send_simple(LwqqClient* lc,int type,const char* to,const char* mess
     c->data.str = s_strdup(message);
     TAILQ_INSERT_TAIL(&mmsg->content,c,entries);
 
-    LWQQ_SYNC(lwqq_msg_send(lc,msg));
+    LWQQ_SYNC_TIMEOUT(lwqq_msg_send(lc,msg),LWQQ_MSG_WAIT_TIMEOUT,ret);
 
     mmsg->f_name = NULL;
     mmsg->f_color = NULL;
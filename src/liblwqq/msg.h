@@ -35,11 +35,13 @@ typedef struct LwqqMsgContent {
             size_t size;
             int success;
             char* file_path;
+            char* path;///< local file uploaded when data is NULL
         }img;
         struct {
             char* name;
             char* data;
             size_t size;
+            char* path;///< local file uploaded when data is NULL
             char* file_id;
             char* key;
             char serv_ip[24];
@@ -178,7 +180,15 @@ void lwqq_recvmsg_free(LwqqRecvMsgList *list);
 
 
 /**
+ * queue a message to send. messages of a client are sent in order and
+ * paced by a token bucket, a message refused by retcode 108 (too fast)
+ * is resent after the rate is lowered. a client without send limiter
+ * sends it right away, unpaced.
  *
+ * ownership: caller still owns msg, but it is serialized only when it
+ * leaves the queue, so it must stay alive and unchanged until the
+ * returned event finished. free it in the listener, never right after
+ * this call. if NULL is returned msg is not used and can be freed.
  *
  * @param lc
  * @param sendmsg
@@ -186,13 +196,22 @@ void lwqq_recvmsg_free(LwqqRecvMsgList *list);
  *
  */
 LwqqAsyncEvent* lwqq_msg_send(LwqqClient *lc, LwqqMsg *msg);
+/**
+ * set max send rate of a client, rate drops after 108 and grows back to it.
+ * @param rate messages per second. 0 keep old value
+ * @param burst messages can be sent at once after idle. 0 keep old value
+ */
+void lwqq_msg_set_send_rate(LwqqClient* lc,double rate,int burst);
+LwqqSendLimiter* lwqq_send_limiter_new(LwqqClient* lc);
+/** queued messages finish with LWQQ_EC_CANCELED */
+void lwqq_send_limiter_free(LwqqSendLimiter* l);
 
 /**
  * easy way to send message
  * @param type LWQQ_MT_BUDDY_MSG or LWQQ_MT_GROUP_MSG
  * @param to buddy uin or group gid
  * @param message
- * @return same as lwqq_msg_send
+ * @return result of lwqq_msg_send, LWQQ_EC_TIMEOUT if not sent in time
  */
 int lwqq_msg_send_simple(LwqqClient* lc,int type,const char* to,const char* message);
 /**
@@ -213,6 +232,8 @@ int lwqq_msg_send_simple(LwqqClient* lc,int type,const char* to,const char* mess
  *          c->img.data is set to file content pointer.
  *          c->img.size is set to file content length.
  *          you should free picture data by hand.(use event listener)
+ *          or set c->img.path instead of data and size, the file
+ *          is read while uploading.
  */
 LwqqAsyncEvent* lwqq_msg_upload_offline_pic(LwqqClient* lc,const char* to,LwqqMsgContent* c);
 /** it upload a picture use cface mode.
@@ -224,6 +245,8 @@ LwqqAsyncEvent* lwqq_msg_upload_offline_pic(LwqqClient* lc,const char* to,LwqqMs
  *          c->cface.data is set to file content pointer.
  *          c->cface.size is set to file content length.
  *          you should free picture data by hand.(use event listener)
+ *          or set c->cface.path instead of data and size, the file
+ *          is read while uploading.
  */
 LwqqAsyncEvent* lwqq_msg_upload_cface(LwqqClient* lc,LwqqMsgType,LwqqMsgContent* c);
 
@@ -9,12 +9,14 @@
  */
 
 #include <string.h>
+#include <stddef.h>
 #include <sys/time.h>
 #include <locale.h>
 #include "type.h"
 #include "smemory.h"
 #include "logger.h"
 #include "msg.h"
+#include "async.h"
 
 /** 
  * Create a new lwqq client
@@ -46,8 +48,10 @@ LwqqClient *lwqq_client_new(const char *username, const char *password)
     lc->myself->uin = s_strdup(username);
 
     lc->cookies = s_malloc0(sizeof(*(lc->cookies)));
+    pthread_mutex_init(&lc->cookies->lock,NULL);
 
     lc->msg_list = lwqq_recvmsg_new(lc);
+    lc->send_limiter = lwqq_send_limiter_new(lc);
 
     /* Set msg_id */
     gettimeofday(&tv, NULL);
@@ -72,11 +76,124 @@ failed:
  */
 char *lwqq_get_cookies(LwqqClient *lc)
 {
-    if (lc->cookies && lc->cookies->lwcookies) {
-        return s_strdup(lc->cookies->lwcookies);
+    LwqqCookieHeader *h = lwqq_get_cookie_header(lc);
+    char *ret = NULL;
+    if (h) {
+        ret = s_strdup(h->value);
+        lwqq_cookie_header_unref(h);
     }
 
-    return NULL;
+    return ret;
+}
+
+LwqqCookieHeader *lwqq_get_cookie_header(LwqqClient *lc)
+{
+    LwqqCookieHeader *h = NULL;
+    if (!lc || !lc->cookies)
+        return NULL;
+
+    pthread_mutex_lock(&lc->cookies->lock);
+    h = lwqq_cookie_header_ref(lc->cookies->header);
+    pthread_mutex_unlock(&lc->cookies->lock);
+    return h;
+}
+
+LwqqCookieHeader *lwqq_cookie_header_ref(LwqqCookieHeader *h)
+{
+    if (h)
+        __sync_add_and_fetch(&h->ref, 1);
+    return h;
+}
+
+void lwqq_cookie_header_unref(LwqqCookieHeader *h)
+{
+    if (h && __sync_sub_and_fetch(&h->ref, 1) == 0)
+        s_free(h);
+}
+
+/** cookies webqq needs, in the order they are sent */
+static const struct {
+    const char *name;
+    size_t offset;
+} cookie_fields[] = {
+    {"ptvfsession",   offsetof(LwqqCookies, ptvfsession)},
+    {"ptcz",          offsetof(LwqqCookies, ptcz)},
+    {"skey",          offsetof(LwqqCookies, skey)},
+    {"ptwebqq",       offsetof(LwqqCookies, ptwebqq)},
+    {"ptuserinfo",    offsetof(LwqqCookies, ptuserinfo)},
+    {"uin",           offsetof(LwqqCookies, uin)},
+    {"ptisp",         offsetof(LwqqCookies, ptisp)},
+    {"pt2gguin",      offsetof(LwqqCookies, pt2gguin)},
+    {"verifysession", offsetof(LwqqCookies, verifysession)},
+};
+#define COOKIE_FIELDS (sizeof(cookie_fields)/sizeof(cookie_fields[0]))
+#define COOKIE_FIELD(c, i) (*(char **)((char *)(c) + cookie_fields[i].offset))
+
+#define COOKIE_PREFIX "Cookie: "
+
+/** build "Cookie: a=1; b=2; " in one allocation, caller holds cookies->lock */
+static LwqqCookieHeader *cookie_header_build(LwqqCookies *cookies)
+{
+    size_t len = 0;
+    size_t i, n;
+    char *p;
+    for (i = 0; i < COOKIE_FIELDS; i++) {
+        if (COOKIE_FIELD(cookies, i))
+            len += strlen(cookie_fields[i].name) + strlen(COOKIE_FIELD(cookies, i)) + 3;
+    }
+    if (len == 0)
+        return NULL;
+
+    LwqqCookieHeader *h = s_malloc(sizeof(*h) + strlen(COOKIE_PREFIX) + len + 1);
+    h->ref = 1;
+    strcpy(h->line, COOKIE_PREFIX);
+    h->value = h->line + strlen(COOKIE_PREFIX);
+    p = h->line + strlen(COOKIE_PREFIX);
+    for (i = 0; i < COOKIE_FIELDS; i++) {
+        const char *value = COOKIE_FIELD(cookies, i);
+        if (!value)
+            continue;
+        n = strlen(cookie_fields[i].name);
+        memcpy(p, cookie_fields[i].name, n);
+        p += n;
+        *p++ = '=';
+        n = strlen(value);
+        memcpy(p, value, n);
+        p += n;
+        *p++ = ';';
+        *p++ = ' ';
+    }
+    *p = '\0';
+    return h;
+}
+
+void lwqq_cookies_update(LwqqCookies *cookies, const char *key,
+                         const char *value, int update_cache)
+{
+    LwqqCookieHeader *old = NULL;
+    size_t i;
+    if (!cookies || !key || !value)
+        return ;
+
+    pthread_mutex_lock(&cookies->lock);
+    for (i = 0; i < COOKIE_FIELDS; i++) {
+        if (!strcmp(key, cookie_fields[i].name))
+            break;
+    }
+    if (i == COOKIE_FIELDS) {
+        lwqq_log(LOG_WARNING, "No this cookie: %s\n", key);
+    } else if (!COOKIE_FIELD(cookies, i) || strcmp(COOKIE_FIELD(cookies, i), value)) {
+        s_free(COOKIE_FIELD(cookies, i));
+        COOKIE_FIELD(cookies, i) = s_strdup(value);
+    }
+
+    //requests still hold the old one
+    if (update_cache) {
+        old = cookies->header;
+        cookies->header = cookie_header_build(cookies);
+    }
+    pthread_mutex_unlock(&cookies->lock);
+    lwqq_cookie_header_unref(old);
 }
 
 void lwqq_vc_free(LwqqVerifyCode *vc)
@@ -102,7 +219,8 @@ static void cookies_free(LwqqCookies *c)
         s_free(c->ptisp);
         s_free(c->pt2gguin);
         s_free(c->verifysession);
-        s_free(c->lwcookies);
+        lwqq_cookie_header_unref(c->header);
+        pthread_mutex_destroy(&c->lock);
         s_free(c);
     }
 }
@@ -130,6 +248,9 @@ void lwqq_client_free(LwqqClient *client)
     if (!client)
         return ;
 
+    /* Drop pending listener calls before what they point to is freed */
+    lwqq_async_set(client,0);
+
     /* Free LwqqVerifyCode instance */
     s_free(client->username);
     s_free(client->password);
@@ -167,6 +288,7 @@ void lwqq_client_free(LwqqClient *client)
 
     /* Free msg_list */
     lwqq_recvmsg_free(client->msg_list);
+    lwqq_send_limiter_free(client->send_limiter);
     s_free(client);
 }
 
@@ -125,9 +125,21 @@ typedef struct LwqqCookies {
     char *ptisp;
     char *pt2gguin;
     char *verifysession;
-    char *lwcookies;
+    /** "Cookie" header value, replaced as a whole when cookie changed */
+    struct LwqqCookieHeader *header;
+    pthread_mutex_t lock;
 } LwqqCookies;
+/**
+ * immutable snapshot of cookies, requests share it instead of copying.
+ * a holder must lwqq_cookie_header_unref() it when done.
+ */
+typedef struct LwqqCookieHeader {
+    int ref;
+    const char *value;          /**< "a=1; b=2; " part of line */
+    char line[];                /**< "Cookie: a=1; b=2; " */
+} LwqqCookieHeader;
 typedef struct _LwqqAsync LwqqAsync;
+typedef struct LwqqSendLimiter LwqqSendLimiter;
 /* LwqqClient API */
 typedef struct LwqqClient {
     char *username;             /**< Username */
@@ -147,6 +159,7 @@ typedef struct LwqqClient {
     char *gface_sig;                  /**<use at cfage */
     LwqqAsync* async;
     LwqqCookies *cookies;
+    LwqqSendLimiter *send_limiter;  /**< paces lwqq_msg_send */
     LIST_HEAD(, LwqqBuddy) friends; /**< QQ friends */
     LIST_HEAD(, LwqqFriendCategory) categories; /**< QQ friends categories */
     LIST_HEAD(, LwqqGroup) groups; /**< QQ groups */
@@ -163,6 +176,8 @@ typedef enum {
     LWQQ_EC_LOGIN_NEED_VC = 10,
     LWQQ_EC_NETWORK_ERROR = 20,
     LWQQ_EC_HTTP_ERROR = 30,
+    LWQQ_EC_CANCELED = 40,
+    LWQQ_EC_TIMEOUT,///< gave up waiting at deadline
     LWQQ_EC_DB_EXEC_FAIELD = 50,
     LWQQ_EC_DB_CLOSE_FAILED,
 } LwqqErrorCode;
@@ -190,6 +205,24 @@ LwqqClient *lwqq_client_new(const char *username, const char *password);
  */
 char *lwqq_get_cookies(LwqqClient *lc);
 
+/**
+ * Get a reference of current cookie header, it would not change even if
+ * cookies are updated later.
+ *
+ * @return NULL if there is no cookie yet
+ */
+LwqqCookieHeader *lwqq_get_cookie_header(LwqqClient *lc);
+LwqqCookieHeader *lwqq_cookie_header_ref(LwqqCookieHeader *h);
+void lwqq_cookie_header_unref(LwqqCookieHeader *h);
+
+/**
+ * Update a cookie needed by webqq, thread safe.
+ *
+ * @param update_cache Rebuild cookie header, pass 0 to batch updates
+ */
+void lwqq_cookies_update(LwqqCookies *cookies, const char *key,
+                         const char *value, int update_cache);
+
 /** 
  * Free LwqqVerifyCode object
  * 
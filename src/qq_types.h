@@ -16,6 +16,7 @@ typedef struct qq_account {
         LOAD_COMPLETED
     }state;
     GPtrArray* opend_chat;
+    gint64 login_start;///< monotonic time login started, for benchmark
     int magic;//0x4153
 } qq_account;
 qq_account* qq_account_new(PurpleAccount* account);
@@ -15,6 +15,8 @@
 #endif
 
 #define FACE_DIR INST_PREFIX"/share/pixmaps/pidgin/emotes/webqq/"
+/** sending thread gives up waiting picture upload after this ms */
+#define UPLOAD_TIMEOUT 120000
 static GHashTable* smily_table;
 static TRex* _regex;
 const char* SMILY_EXP = "<IMG ID=\"\\d+\">|\\[FACE_\\d+\\]|"
@@ -90,6 +92,8 @@ int translate_message_to_struct(LwqqClient* lc,const char* to,const char* what,L
     //trex_clear(x);
 
     LwqqAsyncEvset* set = lwqq_async_evset_new();
+    //before uploads are issued, so transfers get it as timeout
+    lwqq_async_evset_set_deadline(set,UPLOAD_TIMEOUT);
     LwqqAsyncEvent* event;
      
     while(*ptr!='\0'){
@@ -5,11 +5,16 @@
 #include <smemory.h>
 #include <request.h>
 #include <signal.h>
+#include <accountopt.h>
+#include <prefs.h>
+#include <util.h>
+#include <debug.h>
 
 #include <type.h>
 #include <async.h>
 #include <msg.h>
 #include <info.h>
+#include <http.h>
 
 #include "internal.h"
 #include "webqq.h"
@@ -23,6 +28,11 @@ char *qq_get_cb_real_name(PurpleConnection *gc, int id, const char *who);
 static void client_connect_signals(PurpleConnection* gc);
 static void group_member_list_come(LwqqAsyncEvent* event,void* data);
 static void group_message_delay_display(LwqqAsyncEvent* event,void* data);
+/** logged in accounts, smiley table is shared by them */
+static int account_count = 0;
+//engine wide, shared by all accounts, read once on first login
+#define PREF_ROOT "/plugins/prpl/webqq"
+#define PREF_MULTIPLEX PREF_ROOT"/multiplex"
 
 static LwqqBuddy* find_buddy_by_qqnumber(LwqqClient* lc,const char* qqnum)
 {
@@ -78,6 +88,44 @@ static void visit_self_infocenter(PurplePluginAction *action)
     snprintf(url,sizeof(url),"gnome-open 'http://user.qzone.qq.com/%s/infocenter'",ac->qq->myself->uin);
     system(url);
 }
+/** write a dump into user dir and show it */
+static void show_dump(PurpleConnection* gc,const char* title,const char* file,
+        void (*dump)(FILE* f))
+{
+    char* path = g_build_filename(purple_user_dir(),file,NULL);
+    char* content = NULL;
+    FILE* f = fopen(path,"w");
+    if(f == NULL){
+        purple_notify_error(gc,title,"无法写入文件",path);
+        g_free(path);
+        return;
+    }
+    dump(f);
+    fclose(f);
+    if(g_file_get_contents(path,&content,NULL,NULL)){
+        char* escaped = g_markup_escape_text(content,-1);
+        char* html = g_strdup_printf("<pre>%s</pre>",escaped);
+        purple_notify_formatted(gc,title,path,NULL,html,NULL,NULL);
+        g_free(html);
+        g_free(escaped);
+        g_free(content);
+    }
+    g_free(path);
+}
+static void dump_http_timing(PurplePluginAction *action)
+{
+    show_dump(action->context,"HTTP统计","webqq-http-timing.txt",lwqq_http_timing_dump);
+}
+/** events alive longer than this are listed as stuck */
+#define ASYNC_STUCK_MS 30000
+static void async_dump(FILE* f)
+{
+    lwqq_async_registry_dump(f,ASYNC_STUCK_MS);
+}
+static void dump_async_events(PurplePluginAction *action)
+{
+    show_dump(action->context,"异步事件统计","webqq-async-events.txt",async_dump);
+}
 
 static GList *plugin_actions(PurplePlugin *UNUSED(plugin), gpointer context)
 {
@@ -94,6 +142,10 @@ static GList *plugin_actions(PurplePlugin *UNUSED(plugin), gpointer context)
     m = g_list_append(m, act);
     act = purple_plugin_action_new("访问个人中心",visit_self_infocenter);
     m = g_list_append(m, act);
+    act = purple_plugin_action_new("HTTP统计",dump_http_timing);
+    m = g_list_append(m, act);
+    act = purple_plugin_action_new("异步事件统计",dump_async_events);
+    m = g_list_append(m, act);
 
     return m;
 }
@@ -539,6 +591,8 @@ void qq_set_basic_info(int result,void* data)
     }
 
     ac->state = LOAD_COMPLETED;
+    purple_debug_info("webqq","load completed in %ld ms\n",
+            (long)((g_get_monotonic_time()-ac->login_start)/1000));
     background_msg_poll(ac);
 }
 
@@ -778,6 +832,7 @@ static void on_create(void *data)
 }
 static void qq_login(PurpleAccount *account)
 {
+    account_count++;
     translate_global_init();
     PurpleConnection* pc= purple_account_get_connection(account);
     qq_account* ac = qq_account_new(account);
@@ -790,6 +845,18 @@ static void qq_login(PurpleAccount *account)
     ac->gc = pc;
     ac->qq = lwqq_client_new(username,password);
     lwqq_async_set(ac->qq,1);
+    lwqq_http_client_attach(ac->qq);
+    if(account_count == 1){
+        //engine is shared, later accounts must not override these
+        lwqq_http_set_multiplex(purple_prefs_get_bool(PREF_MULTIPLEX),0,0);
+        //point to local mock server and record responses for offline benchmark
+        lwqq_http_set_base_url(g_getenv("LWQQ_BASE_URL"));
+        lwqq_http_set_record_dir(g_getenv("LWQQ_RECORD_DIR"));
+        //track live async events, see "异步事件统计" action
+        if(g_getenv("LWQQ_ASYNC_REGISTRY"))
+            lwqq_async_registry_enable(1);
+    }
+    ac->login_start = g_get_monotonic_time();
     purple_connection_set_protocol_data(pc,ac);
     client_connect_signals(ac->gc);
 
@@ -808,11 +875,16 @@ static void qq_close(PurpleConnection *gc)
         background_msg_drain(ac);
         lwqq_logout(ac->qq,&err);
     }
+    //callbacks of unfinished requests would touch freed client,
+    //requests of other accounts keep going
+    lwqq_http_client_detach(ac->qq);
     lwqq_client_free(ac->qq);
     qq_account_free(ac);
     purple_connection_set_protocol_data(gc,NULL);
-    translate_global_free();
-    lwqq_http_global_free();
+    if(--account_count == 0){
+        translate_global_free();
+        lwqq_async_pool_clean();
+    }
 }
 static void
 init_plugin(PurplePlugin *plugin)
@@ -823,6 +895,9 @@ init_plugin(PurplePlugin *plugin)
     bindtextdomain(GETTEXT_PACKAGE , LOCALE_DIR);
     textdomain(GETTEXT_PACKAGE);
 #endif
+    //connection multiplex(experimental) is for all accounts
+    purple_prefs_add_none(PREF_ROOT);
+    purple_prefs_add_bool(PREF_MULTIPLEX,FALSE);
 }
 //send change markname to server.
 static void qq_change_markname(PurpleConnection* gc,const char* who,const char *alias)